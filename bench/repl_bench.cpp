@@ -0,0 +1,311 @@
+// Replay REPL transcripts through the statement path of the REPL, after sessions of different
+// sizes, and report latency percentiles of each pipeline stage and the growth of memory. Input
+// read together is compiled in batches like the REPL does, and each batch or command counts as
+// one statement. Each session runs in a process of its own, so memory is measured from a fresh
+// JIT.
+//
+// It can be used as a regression gate: it exits with 1 if --max-p99 or --max-rss-growth is
+// exceeded.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+#include "logging.h"
+#include "option.h"
+#include "repl.h"
+#include "strings.h"
+
+enum Stage {
+  STAGE_PARSE,
+  STAGE_CODE,
+  STAGE_OPT,
+  STAGE_JIT,
+  STAGE_EXECUTE,
+  STAGE_TOTAL,
+  STAGE_COUNT,
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+    "parse", "codegen", "opt", "jit", "execute", "total",
+};
+
+struct BenchOption {
+  BenchOption()
+      : sessions({10, 1000, 10000}), repeat(5), max_p99_ms(0.0), max_rss_growth_mb(0.0) {
+  }
+
+  std::vector<size_t> sessions;
+  size_t repeat;
+  // Limits of the regression gate, 0 means no limit.
+  double max_p99_ms;
+  double max_rss_growth_mb;
+  std::vector<std::string> transcripts;
+};
+
+struct SessionResult {
+  size_t definitions;
+  std::vector<double> stage_ms[STAGE_COUNT];
+  double rss_start_mb;
+  double rss_defined_mb;
+  double rss_end_mb;
+};
+
+static void usage(const std::string& exec_name) {
+  printf(
+      "Usage: %s [options] transcript...\n"
+      "Replay REPL transcripts after making function definitions, each\n"
+      "session in a new process, and report latency percentiles of each\n"
+      "stage.\n"
+      "--sessions n1,n2,...\n"
+      "                Numbers of definitions made before replaying.\n"
+      "                Default is 10,1000,10000.\n"
+      "--repeat <n>    Replay the transcripts n times in each session.\n"
+      "                Default is 5.\n"
+      "--max-p99 <ms>  Fail if the p99 latency of statements exceeds it.\n"
+      "--max-rss-growth <mb>\n"
+      "                Fail if the RSS grows more than it in a session.\n",
+      exec_name.c_str());
+}
+
+static bool parseOptions(int argc, char** argv, BenchOption* option) {
+  std::vector<std::string> args(argv, argv + argc);
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (args[i] == "-h" || args[i] == "--help") {
+      usage(args[0]);
+      exit(0);
+    } else if (args[i] == "--sessions" || args[i] == "--repeat" || args[i] == "--max-p99" ||
+               args[i] == "--max-rss-growth") {
+      if (i + 1 == args.size()) {
+        LOG(ERROR) << "No argument following " << args[i] << " option.";
+        return false;
+      }
+      const std::string& value = args[++i];
+      if (args[i - 1] == "--sessions") {
+        option->sessions.clear();
+        for (auto& s : stringSplit(value, ',')) {
+          option->sessions.push_back(strtoul(s.c_str(), nullptr, 10));
+        }
+      } else if (args[i - 1] == "--repeat") {
+        option->repeat = strtoul(value.c_str(), nullptr, 10);
+      } else if (args[i - 1] == "--max-p99") {
+        option->max_p99_ms = strtod(value.c_str(), nullptr);
+      } else {
+        option->max_rss_growth_mb = strtod(value.c_str(), nullptr);
+      }
+    } else if (args[i][0] == '-') {
+      LOG(ERROR) << "Unknown Option: " << args[i];
+      return false;
+    } else {
+      option->transcripts.push_back(args[i]);
+    }
+  }
+  if (option->transcripts.empty()) {
+    LOG(ERROR) << "No transcript to replay";
+    return false;
+  }
+  return true;
+}
+
+static double getRssMb() {
+  std::ifstream ifs("/proc/self/statm");
+  size_t size = 0;
+  size_t resident = 0;
+  ifs >> size >> resident;
+  return resident * static_cast<double>(sysconf(_SC_PAGESIZE)) / (1024 * 1024);
+}
+
+// Nearest-rank percentile of sorted values.
+static double getPercentile(const std::vector<double>& values, double percent) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  size_t rank = static_cast<size_t>(percent / 100 * values.size() + 0.5);
+  rank = std::min(std::max<size_t>(rank, 1), values.size());
+  return values[rank - 1];
+}
+
+static void runSession(size_t definitions, const std::string& transcript, size_t repeat,
+                       SessionResult* result) {
+  result->definitions = definitions;
+  result->rss_start_mb = getRssMb();
+  prepareRepl();
+
+  std::string session;
+  for (size_t i = 0; i < definitions; ++i) {
+    session += stringPrintf("def bench_f%zu(x) x * %zu + 1;\n", i, i);
+  }
+  std::istringstream session_stream(session);
+  global_option.in_stream = &session_stream;
+  replLoop();
+  result->rss_defined_mb = getRssMb();
+
+  std::string replay;
+  for (size_t i = 0; i < repeat; ++i) {
+    replay += transcript + "\n";
+  }
+  std::istringstream replay_stream(replay);
+  global_option.in_stream = &replay_stream;
+  // The lexer has seen the end of the session input.
+  resetLexer();
+  setStatementTimeCallback([result](const StatementTime& time) {
+    result->stage_ms[STAGE_PARSE].push_back(time.parse_seconds * 1000);
+    result->stage_ms[STAGE_CODE].push_back(time.code_seconds * 1000);
+    result->stage_ms[STAGE_OPT].push_back(time.opt_seconds * 1000);
+    result->stage_ms[STAGE_JIT].push_back(time.execution.jit_seconds * 1000);
+    result->stage_ms[STAGE_EXECUTE].push_back(time.execution.execute_seconds * 1000);
+    result->stage_ms[STAGE_TOTAL].push_back(time.total_seconds * 1000);
+  });
+  replLoop();
+  setStatementTimeCallback(nullptr);
+  result->rss_end_mb = getRssMb();
+  global_option.in_stream = &std::cin;
+
+  finishRepl();
+  for (auto& values : result->stage_ms) {
+    std::sort(values.begin(), values.end());
+  }
+}
+
+static void writeResult(const SessionResult& result, FILE* fp) {
+  fprintf(fp, "%zu %.17g %.17g %.17g\n", result.definitions, result.rss_start_mb,
+          result.rss_defined_mb, result.rss_end_mb);
+  for (auto& values : result.stage_ms) {
+    fprintf(fp, "%zu", values.size());
+    for (auto value : values) {
+      fprintf(fp, " %.17g", value);
+    }
+    fprintf(fp, "\n");
+  }
+}
+
+static bool readResult(FILE* fp, SessionResult* result) {
+  if (fscanf(fp, "%zu %lf %lf %lf", &result->definitions, &result->rss_start_mb,
+             &result->rss_defined_mb, &result->rss_end_mb) != 4) {
+    return false;
+  }
+  for (auto& values : result->stage_ms) {
+    size_t count;
+    if (fscanf(fp, "%zu", &count) != 1) {
+      return false;
+    }
+    values.resize(count);
+    for (auto& value : values) {
+      if (fscanf(fp, "%lf", &value) != 1) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Run the session in a child process, whose output of replayed statements is discarded, and
+// read its result through a pipe.
+static bool runSessionProcess(size_t definitions, const std::string& transcript, size_t repeat,
+                              SessionResult* result) {
+  int fds[2];
+  CHECK_NE(pipe(fds), -1) << strerror(errno);
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  CHECK_NE(pid, -1) << strerror(errno);
+  if (pid == 0) {
+    close(fds[0]);
+    int null_fd = open("/dev/null", O_WRONLY);
+    CHECK(null_fd != -1 && dup2(null_fd, STDOUT_FILENO) != -1) << strerror(errno);
+    runSession(definitions, transcript, repeat, result);
+    fflush(stdout);
+    FILE* fp = fdopen(fds[1], "w");
+    CHECK(fp != nullptr) << strerror(errno);
+    writeResult(*result, fp);
+    fclose(fp);
+    _exit(0);
+  }
+  close(fds[1]);
+  FILE* fp = fdopen(fds[0], "r");
+  CHECK(fp != nullptr) << strerror(errno);
+  bool ret = readResult(fp, result);
+  fclose(fp);
+  int status;
+  CHECK_NE(waitpid(pid, &status, 0), -1) << strerror(errno);
+  return ret && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv) {
+  BenchOption option;
+  if (!parseOptions(argc, argv, &option)) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::string transcript;
+  for (auto& path : option.transcripts) {
+    std::string content;
+    if (!readStringFromFile(path, &content)) {
+      LOG(ERROR) << "Can't read transcript " << path;
+      return 1;
+    }
+    transcript += content + "\n";
+  }
+  global_option.interactive = true;
+  global_option.execute = true;
+  global_option.dump_code = false;
+  global_option.log_level = ERROR;
+
+  // Prompts, results and output of the replayed statements are discarded, stdout is only used
+  // for the report.
+  std::ofstream null_stream("/dev/null");
+  global_option.out_stream = &null_stream;
+  std::vector<SessionResult> results(option.sessions.size());
+  for (size_t i = 0; i < option.sessions.size(); ++i) {
+    if (!runSessionProcess(option.sessions[i], transcript, option.repeat, &results[i])) {
+      LOG(ERROR) << "Session with " << option.sessions[i] << " definitions failed";
+      return 1;
+    }
+    fprintf(stderr, "session with %zu definitions done\n", option.sessions[i]);
+  }
+
+  bool pass = true;
+  printf("%-12s %-8s %8s %10s %10s %10s\n", "definitions", "stage", "count", "p50_ms", "p95_ms",
+         "p99_ms");
+  for (auto& result : results) {
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+      const std::vector<double>& values = result.stage_ms[stage];
+      printf("%-12zu %-8s %8zu %10.3f %10.3f %10.3f\n", result.definitions, stage_names[stage],
+             values.size(), getPercentile(values, 50), getPercentile(values, 95),
+             getPercentile(values, 99));
+    }
+    double p99 = getPercentile(result.stage_ms[STAGE_TOTAL], 99);
+    if (option.max_p99_ms > 0 && p99 > option.max_p99_ms) {
+      printf("FAIL: p99 latency %.3f ms > %.3f ms with %zu definitions\n", p99,
+             option.max_p99_ms, result.definitions);
+      pass = false;
+    }
+  }
+  printf("\n%-12s %14s %14s %14s %14s\n", "definitions", "rss_start_mb", "rss_defined_mb",
+         "rss_end_mb", "kb_per_def");
+  for (auto& result : results) {
+    double growth_mb = result.rss_end_mb - result.rss_start_mb;
+    double definition_mb = result.rss_defined_mb - result.rss_start_mb;
+    printf("%-12zu %14.1f %14.1f %14.1f %14.2f\n", result.definitions, result.rss_start_mb,
+           result.rss_defined_mb, result.rss_end_mb,
+           (result.definitions == 0 ? 0.0 : definition_mb * 1024 / result.definitions));
+    if (option.max_rss_growth_mb > 0 && growth_mb > option.max_rss_growth_mb) {
+      printf("FAIL: RSS grows %.1f MB > %.1f MB with %zu definitions\n", growth_mb,
+             option.max_rss_growth_mb, result.definitions);
+      pass = false;
+    }
+  }
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+#ifndef TOY_BLOCKING_QUEUE_H_
+#define TOY_BLOCKING_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// A queue passing values between threads. After close(), pop() returns the remaining values,
+// then returns false.
+template <typename T>
+class BlockingQueue {
+ public:
+  BlockingQueue() : closed_(false) {
+  }
+
+  void push(T value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(value));
+    cond_.notify_one();
+  }
+
+  bool pop(T* value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return !queue_.empty() || closed_; });
+    if (queue_.empty()) {
+      return false;
+    }
+    *value = std::move(queue_.front());
+    queue_.pop_front();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    cond_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<T> queue_;
+  bool closed_;
+};
+
+#endif  // TOY_BLOCKING_QUEUE_H_
@@ -1,5 +1,11 @@
 #include "code.h"
 
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
 #include <unordered_map>
 #include <vector>
 
@@ -12,6 +18,7 @@
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/ValueSymbolTable.h>
@@ -25,18 +32,49 @@
 #include "logging.h"
 #include "optimization.h"
 #include "option.h"
+#include "parallel.h"
 #include "parse.h"
+#include "profile.h"
 #include "strings.h"
 #include "supportlib.h"
 
+// In pipeline mode, each module is generated in a context of its own, which is deleted with the
+// module, see deleteModule().
 static llvm::LLVMContext* context;
 static llvm::Module* cur_module;
 static llvm::Function* global_function;
 static llvm::Function* cur_function;
 static std::unique_ptr<llvm::IRBuilder<>> cur_builder;
-static std::vector<PrototypeAST*> extern_functions;
-static std::vector<std::string> extern_variables;
+// Functions defined or declared in previous modules. They are only declared in a module when
+// it uses them.
+static std::unordered_map<std::string, PrototypeAST*> extern_functions;
+// Functions defined in precompiled preludes, declared again by each prepareCodePipeline().
+static std::vector<PrototypeAST*> prelude_functions;
+// The latest definition of each function in interactive mode, with the number of global
+// variables existing when it was generated. Snapshots generate the functions again, and names
+// of later global variables still refer to locals in them.
+struct FunctionDefinition {
+  FunctionAST* function;
+  size_t visible_global_variables;
+};
+static std::unordered_map<std::string, FunctionDefinition> function_definitions;
+static size_t visible_global_variables = SIZE_MAX;
+// Global variables are packed into one block of memory, one 8-byte slot each, in creation
+// order. In interactive mode, the block is __toy_globals in supportlib, shared by all modules
+// and addressed by slot offsets. Otherwise it is a struct defined in the module.
+static const char toy_globals_name[] = "__toy_globals";
+static std::vector<std::pair<std::string, ValueType>> global_variables;
+static std::unordered_map<std::string, size_t> global_variable_slots;
+// Addresses of global variables used in the current module.
+static std::unordered_map<std::string, llvm::Constant*> module_global_variables;
 static std::unique_ptr<DebugInfoHelper> debug_info_helper;
+// In non-interactive mode, global variables are only visible to the single module. Those not
+// used by any function are created as locals of __toy_main instead, so they can be promoted
+// to registers.
+static bool promote_global_variables;
+static std::set<std::string> function_variable_names;
+// With --auto-parallel, loops proven to have independent iterations.
+static std::unordered_map<ExprAST*, ParallelLoop> parallel_loops;
 
 class Scope {
  public:
@@ -103,27 +141,72 @@ llvm::Value* NumberExprAST::codegen() {
   return llvm::ConstantFP::get(*context, llvm::APFloat(val_));
 }
 
-llvm::Value* StringLiteralExprAST::codegen() {
-  debug_info_helper->emitLocation(getLoc());
-  std::vector<llvm::Constant*> v;
-  const char* p = val_.c_str();
-  llvm::IntegerType* char_type = llvm::IntegerType::get(*context, 8);
-  do {
-    v.push_back(llvm::ConstantInt::get(char_type, *p));
-  } while (*p++ != '\0');
-  llvm::ArrayType* array_type = llvm::ArrayType::get(char_type, val_.size() + 1);
-  llvm::Constant* array = llvm::ConstantArray::get(array_type, v);
+// String literals defined in the current module, indexed by content.
+static std::unordered_map<std::string, llvm::GlobalVariable*> module_string_literals;
+// String literals defined in previous modules in interactive mode, mapped to their symbol names.
+static std::unordered_map<std::string, std::string> extern_string_literals;
+
+static std::string getStringLiteralName() {
+  static uint64_t literal_count = 0;
+  return stringPrintf("str.%" PRIu64, ++literal_count);
+}
+
+// Each literal is emitted once per module. In interactive mode, it is defined as an external
+// symbol in the first module using it, and only declared in later modules.
+static llvm::GlobalVariable* getStringLiteral(const std::string& val) {
+  auto it = module_string_literals.find(val);
+  if (it != module_string_literals.end()) {
+    return it->second;
+  }
+  llvm::Constant* array = llvm::ConstantDataArray::getString(*context, val);
+  llvm::GlobalVariable* variable;
+  auto extern_it = extern_string_literals.find(val);
+  if (extern_it != extern_string_literals.end()) {
+    variable = new llvm::GlobalVariable(*cur_module, array->getType(), true,
+                                        llvm::GlobalValue::ExternalLinkage, nullptr,
+                                        extern_it->second);
+  } else if (global_option.interactive) {
+    std::string name = getStringLiteralName();
+    variable = new llvm::GlobalVariable(*cur_module, array->getType(), true,
+                                        llvm::GlobalValue::ExternalLinkage, array, name);
+    variable->setUnnamedAddr(true);
+    extern_string_literals[val] = name;
+  } else {
+    variable = new llvm::GlobalVariable(*cur_module, array->getType(), true,
+                                        llvm::GlobalValue::PrivateLinkage, array, ".str");
+    variable->setUnnamedAddr(true);
+  }
+  module_string_literals[val] = variable;
+  return variable;
+}
 
-  llvm::GlobalVariable* variable = new llvm::GlobalVariable(
-      *cur_module, array_type, true, llvm::GlobalValue::InternalLinkage, array);
+// The JIT frees a module only defining a main function after it runs, and a module defining one
+// function when the function is redefined, unless they define global symbols used by later
+// modules. So string literals of these modules are private, and defined again by later modules
+// using them.
+static void makeFreeableStringLiteralsPrivate() {
+  size_t function_count = 0;
+  for (auto& function : *cur_module) {
+    if (!function.isDeclaration() && !function.hasLocalLinkage() && ++function_count > 1) {
+      return;
+    }
+  }
+  for (auto& pair : module_string_literals) {
+    if (!pair.second->isDeclaration()) {
+      pair.second->setLinkage(llvm::GlobalValue::PrivateLinkage);
+      extern_string_literals.erase(pair.first);
+    }
+  }
+}
 
+llvm::Value* StringLiteralExprAST::codegen() {
+  debug_info_helper->emitLocation(getLoc());
+  llvm::GlobalVariable* variable = getStringLiteral(val_);
   llvm::Type* int_type = llvm::Type::getInt32Ty(*context);
   llvm::Constant* zero = llvm::ConstantInt::get(int_type, 0);
-  std::vector<llvm::Value*> v2(1, zero);
-  llvm::Value* array_ptr = cur_builder->CreateInBoundsGEP(variable, v2);
-
-  llvm::Type* char_ptype = llvm::Type::getInt8PtrTy(*context);
-  return cur_builder->CreatePointerCast(array_ptr, char_ptype);
+  std::vector<llvm::Constant*> indices(2, zero);
+  return llvm::ConstantExpr::getInBoundsGetElementPtr(variable->getValueType(), variable,
+                                                      indices);
 }
 
 static std::string getTmpName() {
@@ -136,32 +219,381 @@ static std::string getTmpModuleName() {
   return stringPrintf("tmpmodule.%" PRIu64, ++tmp_count);
 }
 
+static llvm::Type* getLLVMType(ValueType type) {
+  if (type == VALUE_TYPE_INT) {
+    return llvm::Type::getInt64Ty(*context);
+  }
+  if (type == VALUE_TYPE_BOOL) {
+    return llvm::Type::getInt1Ty(*context);
+  }
+  return llvm::Type::getDoubleTy(*context);
+}
+
+// Comparisons produce i1 values, and int variables produce i64 values. They are only converted
+// to double when the value is used as a number, like being stored, returned or passed as an
+// argument.
+static llvm::Value* convertToDouble(llvm::Value* value) {
+  if (value->getType()->isIntegerTy(1)) {
+    return cur_builder->CreateUIToFP(value, llvm::Type::getDoubleTy(*context), getTmpName());
+  }
+  if (value->getType()->isIntegerTy(64)) {
+    return cur_builder->CreateSIToFP(value, llvm::Type::getDoubleTy(*context), getTmpName());
+  }
+  return value;
+}
+
+// Return the value as i64 if it can be done without changing the value, otherwise return
+// nullptr.
+static llvm::Value* getExactInt(llvm::Value* value) {
+  if (value->getType()->isIntegerTy(64)) {
+    return value;
+  }
+  llvm::ConstantFP* constant = llvm::dyn_cast<llvm::ConstantFP>(value);
+  if (constant != nullptr) {
+    double val = constant->getValueAPF().convertToDouble();
+    if (val == floor(val) && fabs(val) <= 9007199254740992.0) {
+      return llvm::ConstantInt::get(llvm::Type::getInt64Ty(*context), static_cast<int64_t>(val),
+                                    true);
+    }
+  }
+  return nullptr;
+}
+
+static llvm::Value* convertToInt(llvm::Value* value) {
+  llvm::Value* int_value = getExactInt(value);
+  if (int_value != nullptr) {
+    return int_value;
+  }
+  if (value->getType()->isIntegerTy(1)) {
+    return cur_builder->CreateZExt(value, llvm::Type::getInt64Ty(*context), getTmpName());
+  }
+  // fptosi of NaN or of a double out of the int range is poison. Like the limits of parallel
+  // loops, these doubles are clamped to the int range, and NaN converts to 0.
+  llvm::Type* int_type = llvm::Type::getInt64Ty(*context);
+  llvm::Value* result = cur_builder->CreateFPToSI(value, int_type, getTmpName());
+  llvm::Value* too_large = cur_builder->CreateFCmpOGE(
+      value, llvm::ConstantFP::get(*context, llvm::APFloat(9223372036854775808.0)), getTmpName());
+  result = cur_builder->CreateSelect(too_large, llvm::ConstantInt::get(int_type, INT64_MAX),
+                                     result, getTmpName());
+  llvm::Value* too_small = cur_builder->CreateFCmpOLT(
+      value, llvm::ConstantFP::get(*context, llvm::APFloat(-9223372036854775808.0)),
+      getTmpName());
+  result = cur_builder->CreateSelect(too_small, llvm::ConstantInt::get(int_type, INT64_MIN, true),
+                                     result, getTmpName());
+  llvm::Value* is_nan = cur_builder->CreateFCmpUNO(value, value, getTmpName());
+  return cur_builder->CreateSelect(is_nan, llvm::ConstantInt::get(int_type, 0), result,
+                                   getTmpName());
+}
+
+static llvm::Value* convertToCondition(llvm::Value* value) {
+  if (value->getType()->isDoubleTy()) {
+    return cur_builder->CreateFCmpONE(value, llvm::ConstantFP::get(*context, llvm::APFloat(0.0)),
+                                      getTmpName());
+  }
+  if (value->getType()->isIntegerTy(64)) {
+    return cur_builder->CreateICmpNE(value, llvm::ConstantInt::get(value->getType(), 0),
+                                     getTmpName());
+  }
+  CHECK(value->getType()->isIntegerTy(1));
+  return value;
+}
+
+static llvm::Value* convertToType(llvm::Value* value, llvm::Type* type) {
+  if (value->getType() == type) {
+    return value;
+  }
+  if (type->isDoubleTy()) {
+    return convertToDouble(value);
+  }
+  if (type->isIntegerTy(64)) {
+    return convertToInt(value);
+  }
+  if (type->isIntegerTy(1)) {
+    return convertToCondition(value);
+  }
+  LOG(FATAL) << "Unexpected type " << type->getTypeID();
+  return nullptr;
+}
+
+static llvm::Constant* getGlobalSegmentAddress(size_t slot, llvm::Type* type) {
+  llvm::GlobalVariable* segment = cur_module->getGlobalVariable(toy_globals_name);
+  if (segment == nullptr) {
+    llvm::ArrayType* segment_type =
+        llvm::ArrayType::get(llvm::Type::getInt8Ty(*context), toy_global_segment_size);
+    segment = new llvm::GlobalVariable(*cur_module, segment_type, false,
+                                       llvm::GlobalValue::ExternalLinkage, nullptr,
+                                       toy_globals_name);
+    segment->setAlignment(4096);
+  }
+  llvm::Type* index_type = llvm::Type::getInt64Ty(*context);
+  std::vector<llvm::Constant*> indices;
+  indices.push_back(llvm::ConstantInt::get(index_type, 0));
+  indices.push_back(llvm::ConstantInt::get(index_type, slot * toy_global_slot_size));
+  llvm::Constant* address =
+      llvm::ConstantExpr::getInBoundsGetElementPtr(segment->getValueType(), segment, indices);
+  return llvm::ConstantExpr::getBitCast(address, type->getPointerTo());
+}
+
+// In non-interactive mode, global variables are placeholders until packGlobalVariables() knows
+// the whole struct.
+static llvm::Constant* getGlobalVariable(const std::string& name) {
+  auto slot_it = global_variable_slots.find(name);
+  if (slot_it == global_variable_slots.end()) {
+    return nullptr;
+  }
+  size_t slot = slot_it->second;
+  if (slot >= visible_global_variables) {
+    return nullptr;
+  }
+  auto it = module_global_variables.find(name);
+  if (it != module_global_variables.end()) {
+    return it->second;
+  }
+  llvm::Type* type = getLLVMType(global_variables[slot].second);
+  llvm::Constant* variable;
+  if (global_option.interactive) {
+    variable = getGlobalSegmentAddress(slot, type);
+  } else {
+    variable = new llvm::GlobalVariable(*cur_module, type, false,
+                                        llvm::GlobalValue::InternalLinkage,
+                                        llvm::Constant::getNullValue(type), name);
+  }
+  module_global_variables[name] = variable;
+  return variable;
+}
+
+static void packGlobalVariables() {
+  if (global_variables.empty()) {
+    return;
+  }
+  std::vector<llvm::Type*> field_types;
+  for (auto& pair : global_variables) {
+    field_types.push_back(getLLVMType(pair.second));
+  }
+  llvm::StructType* struct_type = llvm::StructType::create(*context, field_types, "toy.globals");
+  llvm::GlobalVariable* globals =
+      new llvm::GlobalVariable(*cur_module, struct_type, false, llvm::GlobalValue::InternalLinkage,
+                               llvm::ConstantAggregateZero::get(struct_type), toy_globals_name);
+  llvm::Type* index_type = llvm::Type::getInt32Ty(*context);
+  for (size_t i = 0; i < global_variables.size(); ++i) {
+    llvm::GlobalVariable* placeholder =
+        llvm::cast<llvm::GlobalVariable>(module_global_variables[global_variables[i].first]);
+    std::vector<llvm::Constant*> indices;
+    indices.push_back(llvm::ConstantInt::get(index_type, 0));
+    indices.push_back(llvm::ConstantInt::get(index_type, i));
+    placeholder->replaceAllUsesWith(
+        llvm::ConstantExpr::getInBoundsGetElementPtr(struct_type, globals, indices));
+    placeholder->eraseFromParent();
+  }
+  module_global_variables.clear();
+}
+
+// With --profile-generate or --profile-use, see profile.h. Counters are allocated in the same
+// order in both modes, so they match the counts of a profile generated from the same source.
+struct FunctionProfile {
+  llvm::Function* function;
+  size_t counter_count;
+  // With --profile-generate, counters are placeholders until packProfileCounters() puts the
+  // counters of all functions in one array.
+  std::vector<llvm::GlobalVariable*> counters;
+  // With --profile-use, null if the profile has no counts for the function.
+  const std::vector<uint64_t>* counts;
+};
+
+static bool profile_code;
+static std::vector<FunctionProfile> function_profiles;
+static std::unordered_map<llvm::Function*, size_t> function_profile_indexes;
+
+static FunctionProfile* getFunctionProfile(llvm::Function* function) {
+  auto it = function_profile_indexes.find(function);
+  if (it != function_profile_indexes.end()) {
+    return &function_profiles[it->second];
+  }
+  function_profile_indexes[function] = function_profiles.size();
+  const std::vector<uint64_t>* counts = nullptr;
+  if (!global_option.profile_use_file.empty()) {
+    counts = getProfileCounts(function->getName().str());
+  }
+  function_profiles.push_back(
+      FunctionProfile{function, 0, std::vector<llvm::GlobalVariable*>(), counts});
+  return &function_profiles.back();
+}
+
+// Count the times the current block is entered, and return the counter. It is called when
+// nothing is generated in the block yet.
+static size_t countBlockEntries() {
+  if (!profile_code) {
+    return 0;
+  }
+  FunctionProfile* profile = getFunctionProfile(cur_function);
+  if (!global_option.profile_generate_file.empty()) {
+    llvm::Type* type = llvm::Type::getInt64Ty(*context);
+    llvm::GlobalVariable* counter =
+        new llvm::GlobalVariable(*cur_module, type, false, llvm::GlobalValue::InternalLinkage,
+                                 llvm::Constant::getNullValue(type), "profile_counter");
+    profile->counters.push_back(counter);
+    llvm::Value* count = cur_builder->CreateLoad(counter);
+    cur_builder->CreateStore(cur_builder->CreateAdd(count, llvm::ConstantInt::get(type, 1)),
+                             counter);
+  }
+  return profile->counter_count++;
+}
+
+// Branch weights are 32 bits, so large counts are scaled down. Weights are at least 1, so a
+// target never taken in the profile is unlikely but not impossible.
+static void createCondBr(llvm::Value* cond_value, llvm::BasicBlock* true_block,
+                         size_t true_counter, llvm::BasicBlock* false_block,
+                         size_t false_counter) {
+  llvm::MDNode* weights = nullptr;
+  if (profile_code) {
+    const std::vector<uint64_t>* counts = getFunctionProfile(cur_function)->counts;
+    if (counts != nullptr && std::max(true_counter, false_counter) < counts->size()) {
+      uint64_t true_count = (*counts)[true_counter];
+      uint64_t false_count = (*counts)[false_counter];
+      uint64_t scale = std::max(true_count, false_count) / UINT32_MAX + 1;
+      weights = llvm::MDBuilder(*context).createBranchWeights(
+          static_cast<uint32_t>(true_count / scale + 1),
+          static_cast<uint32_t>(false_count / scale + 1));
+    }
+  }
+  cur_builder->CreateCondBr(cond_value, true_block, false_block, weights);
+}
+
+// Set the entry count of the function from the profile. A function never called in the profile
+// is optimized for size, and calls to it are unlikely. If the function has changed since the
+// profile was generated, its profile is ignored.
+static void finishFunctionProfile(llvm::Function* function) {
+  if (!profile_code) {
+    return;
+  }
+  FunctionProfile* profile = getFunctionProfile(function);
+  if (profile->counts == nullptr) {
+    return;
+  }
+  if (profile->counts->size() != profile->counter_count) {
+    LOG(ERROR) << "Profile of function " << function->getName().str()
+               << " doesn't match its code, it is ignored";
+    for (auto& basic_block : *function) {
+      basic_block.getTerminator()->setMetadata(llvm::LLVMContext::MD_prof, nullptr);
+    }
+    return;
+  }
+  uint64_t entry_count = (*profile->counts)[0];
+  function->setEntryCount(entry_count);
+  if (entry_count == 0) {
+    function->addFnAttr(llvm::Attribute::Cold);
+    function->addFnAttr(llvm::Attribute::OptimizeForSize);
+  }
+}
+
+// Put the counters of all functions in one array, and write them to the profile before
+// __toy_main returns.
+static void packProfileCounters() {
+  size_t counter_count = 0;
+  std::string layout;
+  for (auto& profile : function_profiles) {
+    counter_count += profile.counters.size();
+    layout += stringPrintf("%s %zu\n", profile.function->getName().data(),
+                           profile.counters.size());
+  }
+  llvm::Type* index_type = llvm::Type::getInt64Ty(*context);
+  llvm::ArrayType* array_type = llvm::ArrayType::get(index_type, counter_count);
+  llvm::GlobalVariable* counters = new llvm::GlobalVariable(
+      *cur_module, array_type, false, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantAggregateZero::get(array_type), "__toy_profile_counters");
+  size_t index = 0;
+  for (auto& profile : function_profiles) {
+    for (auto placeholder : profile.counters) {
+      std::vector<llvm::Constant*> indices;
+      indices.push_back(llvm::ConstantInt::get(index_type, 0));
+      indices.push_back(llvm::ConstantInt::get(index_type, index++));
+      placeholder->replaceAllUsesWith(
+          llvm::ConstantExpr::getInBoundsGetElementPtr(array_type, counters, indices));
+      placeholder->eraseFromParent();
+    }
+  }
+
+  llvm::Type* char_ptype = llvm::Type::getInt8PtrTy(*context);
+  std::vector<llvm::Type*> arg_types;
+  arg_types.push_back(char_ptype);
+  arg_types.push_back(char_ptype);
+  arg_types.push_back(index_type->getPointerTo());
+  llvm::Function* write_function = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(*context), arg_types, false),
+      llvm::GlobalValue::ExternalLinkage, toy_write_profile_function_name, cur_module);
+  std::vector<llvm::Value*> args;
+  args.push_back(cur_builder->CreateGlobalStringPtr(global_option.profile_generate_file));
+  args.push_back(cur_builder->CreateGlobalStringPtr(layout));
+  args.push_back(cur_builder->CreateConstInBoundsGEP2_64(counters, 0, 0));
+  cur_builder->CreateCall(write_function, args);
+}
+
+static llvm::Function* getFunction(const std::string& name) {
+  llvm::Function* function = cur_module->getFunction(name);
+  if (function == nullptr) {
+    auto it = extern_functions.find(name);
+    if (it != extern_functions.end()) {
+      // Declaring it shouldn't change the location of the code being generated.
+      llvm::DebugLoc debug_loc = cur_builder->getCurrentDebugLocation();
+      function = it->second->codegen();
+      cur_builder->SetCurrentDebugLocation(debug_loc);
+    }
+  }
+  return function;
+}
+
+bool hasFunction(const std::string& name) {
+  return extern_functions.find(name) != extern_functions.end();
+}
+
 static llvm::Value* getVariable(const std::string& name) {
   llvm::Value* variable = nullptr;
   CHECK(cur_scope != nullptr);
   variable = cur_scope->findVariableFromScopeList(name);
   if (variable == nullptr) {
-    variable = cur_module->getGlobalVariable(name);
+    variable = getGlobalVariable(name);
   }
   return variable;
 }
 
+static llvm::AllocaInst* createEntryBlockAlloca(llvm::Type* type, const std::string& name) {
+  llvm::BasicBlock* entry_block = &cur_function->getEntryBlock();
+  llvm::IRBuilder<> entry_builder(entry_block, entry_block->begin());
+  return entry_builder.CreateAlloca(type, nullptr, name);
+}
+
 // ArgIndex = 0 when it is not an argument.
-static llvm::Value* createVariable(const std::string& name, SourceLocation loc, size_t arg_index) {
-  LOG(DEBUG) << "createVariable, Name " << name;
+static llvm::Value* createVariable(const std::string& name, SourceLocation loc, size_t arg_index,
+                                   ValueType type) {
+  LOG(DEBUG) << "createVariable, Name " << name << ", type " << getValueTypeName(type);
   llvm::Value* variable;
-  if (cur_scope == global_scope.get()) {
-    llvm::Constant* constant = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
-    llvm::GlobalVariable* global_variable =
-        new llvm::GlobalVariable(*cur_module, llvm::Type::getDoubleTy(*context), false,
-                                 llvm::GlobalVariable::ExternalLinkage, constant, name);
-    debug_info_helper->createGlobalVariable(global_variable, loc);
-    variable = global_variable;
-    extern_variables.push_back(name);
+  if (cur_scope == global_scope.get() && promote_global_variables &&
+      function_variable_names.find(name) == function_variable_names.end()) {
+    // Create it in the entry block, and initialize it like a global variable, because the
+    // first assignment may not be executed.
+    llvm::BasicBlock* entry_block = &global_function->getEntryBlock();
+    llvm::IRBuilder<> entry_builder(entry_block, entry_block->begin());
+    llvm::AllocaInst* local_variable =
+        entry_builder.CreateAlloca(getLLVMType(type), nullptr, name);
+    entry_builder.CreateStore(llvm::Constant::getNullValue(getLLVMType(type)), local_variable);
+    debug_info_helper->createLocalVariable(local_variable, loc, arg_index);
+    variable = local_variable;
+    LOG(DEBUG) << "promote global variable " << name;
+  } else if (cur_scope == global_scope.get()) {
+    // Global variables aren't in the scope, because they have different addresses in each
+    // module.
+    global_variable_slots[name] = global_variables.size();
+    global_variables.push_back(std::make_pair(name, type));
+    CHECK(global_variables.size() * toy_global_slot_size <= toy_global_segment_size)
+        << "Too many global variables";
+    llvm::Constant* global_variable = getGlobalVariable(name);
+    debug_info_helper->createGlobalVariable(name, getLLVMType(type), global_variable, loc);
     LOG(DEBUG) << "create global variable " << name;
+    return global_variable;
   } else {
-    llvm::AllocaInst* local_variable =
-        cur_builder->CreateAlloca(llvm::Type::getDoubleTy(*context), nullptr, name);
+    // Created in the entry block, so a variable created in a loop body doesn't take more stack
+    // in each iteration, and it can be promoted to registers.
+    llvm::AllocaInst* local_variable = createEntryBlockAlloca(getLLVMType(type), name);
     debug_info_helper->createLocalVariable(local_variable, loc, arg_index);
     variable = local_variable;
     LOG(DEBUG) << "create local variable " << name;
@@ -170,14 +602,58 @@ static llvm::Value* createVariable(const std::string& name, SourceLocation loc,
   return variable;
 }
 
+// In interactive mode, global variables may be used by jobs running on other threads, so they
+// are accessed with unordered atomic loads and stores. Atomic accesses need integer types of at
+// least 8 bits, so values are converted to such integers of the same size.
+static bool isSharedVariable(llvm::Value* variable) {
+  return global_option.interactive && !llvm::isa<llvm::AllocaInst>(variable);
+}
+
+static llvm::Type* getAtomicType(llvm::Type* type) {
+  unsigned bits = type->getPrimitiveSizeInBits();
+  return llvm::Type::getIntNTy(*context, (bits < 8 ? 8 : bits));
+}
+
+static llvm::Value* loadVariable(llvm::Value* variable) {
+  if (!isSharedVariable(variable)) {
+    return cur_builder->CreateLoad(variable, getTmpName());
+  }
+  llvm::Type* type = variable->getType()->getPointerElementType();
+  llvm::Type* atomic_type = getAtomicType(type);
+  llvm::Value* pointer = cur_builder->CreateBitCast(variable, atomic_type->getPointerTo());
+  llvm::LoadInst* load_inst = cur_builder->CreateLoad(pointer, getTmpName());
+  load_inst->setAtomic(llvm::Unordered);
+  load_inst->setAlignment(atomic_type->getPrimitiveSizeInBits() / 8);
+  if (type->isIntegerTy()) {
+    return cur_builder->CreateTrunc(load_inst, type, getTmpName());
+  }
+  return cur_builder->CreateBitCast(load_inst, type, getTmpName());
+}
+
+static void storeVariable(llvm::Value* value, llvm::Value* variable) {
+  if (!isSharedVariable(variable)) {
+    cur_builder->CreateStore(value, variable);
+    return;
+  }
+  llvm::Type* atomic_type = getAtomicType(value->getType());
+  llvm::Value* pointer = cur_builder->CreateBitCast(variable, atomic_type->getPointerTo());
+  if (value->getType()->isIntegerTy()) {
+    value = cur_builder->CreateZExt(value, atomic_type, getTmpName());
+  } else {
+    value = cur_builder->CreateBitCast(value, atomic_type, getTmpName());
+  }
+  llvm::StoreInst* store_inst = cur_builder->CreateStore(value, pointer);
+  store_inst->setAtomic(llvm::Unordered);
+  store_inst->setAlignment(atomic_type->getPrimitiveSizeInBits() / 8);
+}
+
 llvm::Value* VariableExprAST::codegen() {
   debug_info_helper->emitLocation(getLoc());
   llvm::Value* variable = getVariable(name_);
   if (variable == nullptr) {
     LOG(FATAL) << "Using unassigned variable: " << name_ << ", loc " << getLoc().toString();
   }
-  llvm::LoadInst* load_inst = cur_builder->CreateLoad(variable, getTmpName());
-  return load_inst;
+  return loadVariable(variable);
 }
 
 llvm::Value* UnaryExprAST::codegen() {
@@ -186,18 +662,100 @@ llvm::Value* UnaryExprAST::codegen() {
   CHECK(right_value != nullptr);
   std::string op_str = op_.desc;
   if (op_str == "-") {
-    return cur_builder->CreateFNeg(right_value, getTmpName());
+    if (right_value->getType()->isIntegerTy(64)) {
+      return cur_builder->CreateNeg(right_value, getTmpName());
+    }
+    return cur_builder->CreateFNeg(convertToDouble(right_value), getTmpName());
   }
-  llvm::Function* function = cur_module->getFunction("unary" + op_str);
+  llvm::Function* function = getFunction("unary" + op_str);
   if (function != nullptr) {
     CHECK_EQ(1u, function->arg_size());
-    std::vector<llvm::Value*> values(1, right_value);
+    llvm::FunctionType* function_type = function->getFunctionType();
+    std::vector<llvm::Value*> values(
+        1, convertToType(right_value, function_type->getParamType(0)));
     return cur_builder->CreateCall(function, values, getTmpName());
   }
   LOG(FATAL) << "Unexpected unary operator " << op_str;
   return nullptr;
 }
 
+// sdiv and srem are undefined for a zero divisor and for INT64_MIN / -1, so these divisors are
+// replaced by 1, and the result is picked by select. x / 0 is 0 and x % 0 is x, so
+// x == x / y * y + x % y still holds. x / -1 is -x, which wraps around for INT64_MIN.
+static llvm::Value* createIntDivision(bool is_rem, llvm::Value* left_value,
+                                      llvm::Value* right_value) {
+  llvm::ConstantInt* constant = llvm::dyn_cast<llvm::ConstantInt>(right_value);
+  if (constant != nullptr && !constant->isZero() && !constant->isMinusOne()) {
+    if (is_rem) {
+      return cur_builder->CreateSRem(left_value, right_value, getTmpName());
+    }
+    return cur_builder->CreateSDiv(left_value, right_value, getTmpName());
+  }
+  llvm::Type* type = right_value->getType();
+  llvm::Value* one = llvm::ConstantInt::get(type, 1);
+  // right_value is 0 or -1.
+  llvm::Value* is_special = cur_builder->CreateICmpULT(
+      cur_builder->CreateAdd(right_value, one, getTmpName()), llvm::ConstantInt::get(type, 2),
+      getTmpName());
+  llvm::Value* divisor = cur_builder->CreateSelect(is_special, one, right_value, getTmpName());
+  if (is_rem) {
+    llvm::Value* rem = cur_builder->CreateSRem(left_value, divisor, getTmpName());
+    llvm::Value* is_zero =
+        cur_builder->CreateICmpEQ(right_value, llvm::ConstantInt::get(type, 0), getTmpName());
+    return cur_builder->CreateSelect(is_zero, left_value, rem, getTmpName());
+  }
+  llvm::Value* quotient = cur_builder->CreateSDiv(left_value, divisor, getTmpName());
+  return cur_builder->CreateSelect(
+      is_special, cur_builder->CreateMul(left_value, right_value, getTmpName()), quotient,
+      getTmpName());
+}
+
+// Int arithmetic wraps around on overflow, unless the result is proven to fit. Shift counts
+// are taken modulo 64. Return nullptr if the operator isn't supported in int.
+static llvm::Value* createIntBinaryOp(const std::string& op_str, llvm::Value* left_value,
+                                      llvm::Value* right_value, bool no_signed_wrap,
+                                      bool double_arithmetic) {
+  if (op_str == "<") {
+    return cur_builder->CreateICmpSLT(left_value, right_value, getTmpName());
+  } else if (op_str == "<=") {
+    return cur_builder->CreateICmpSLE(left_value, right_value, getTmpName());
+  } else if (op_str == "==") {
+    return cur_builder->CreateICmpEQ(left_value, right_value, getTmpName());
+  } else if (op_str == "!=") {
+    return cur_builder->CreateICmpNE(left_value, right_value, getTmpName());
+  } else if (op_str == ">") {
+    return cur_builder->CreateICmpSGT(left_value, right_value, getTmpName());
+  } else if (op_str == ">=") {
+    return cur_builder->CreateICmpSGE(left_value, right_value, getTmpName());
+  }
+  if (double_arithmetic) {
+    return nullptr;
+  }
+  if (op_str == "+") {
+    return cur_builder->CreateAdd(left_value, right_value, getTmpName(), false, no_signed_wrap);
+  } else if (op_str == "-") {
+    return cur_builder->CreateSub(left_value, right_value, getTmpName(), false, no_signed_wrap);
+  } else if (op_str == "*") {
+    return cur_builder->CreateMul(left_value, right_value, getTmpName(), false, no_signed_wrap);
+  } else if (op_str == "/" || op_str == "%") {
+    return createIntDivision(op_str == "%", left_value, right_value);
+  } else if (op_str == "&") {
+    return cur_builder->CreateAnd(left_value, right_value, getTmpName());
+  } else if (op_str == "|") {
+    return cur_builder->CreateOr(left_value, right_value, getTmpName());
+  } else if (op_str == "^") {
+    return cur_builder->CreateXor(left_value, right_value, getTmpName());
+  } else if (op_str == "<<" || op_str == ">>") {
+    llvm::Value* shift = cur_builder->CreateAnd(
+        right_value, llvm::ConstantInt::get(right_value->getType(), 63), getTmpName());
+    if (op_str == "<<") {
+      return cur_builder->CreateShl(left_value, shift, getTmpName());
+    }
+    return cur_builder->CreateAShr(left_value, shift, getTmpName());
+  }
+  return nullptr;
+}
+
 llvm::Value* BinaryExprAST::codegen() {
   debug_info_helper->emitLocation(getLoc());
   llvm::Value* left_value = left_->codegen();
@@ -206,14 +764,38 @@ llvm::Value* BinaryExprAST::codegen() {
   CHECK(right_value != nullptr);
   llvm::Value* result = nullptr;
   std::string op_str = op_.desc;
-  llvm::Function* function = cur_module->getFunction("binary" + op_str);
+  llvm::Function* function = getFunction("binary" + op_str);
   if (function != nullptr) {
     CHECK_EQ(2u, function->arg_size());
+    llvm::FunctionType* function_type = function->getFunctionType();
     std::vector<llvm::Value*> values;
-    values.push_back(left_value);
-    values.push_back(right_value);
+    values.push_back(convertToType(left_value, function_type->getParamType(0)));
+    values.push_back(convertToType(right_value, function_type->getParamType(1)));
     return cur_builder->CreateCall(function, values, getTmpName());
   }
+  // Int operators are used when one side is int and the other side is int or an integral
+  // constant, otherwise the int side is converted to double.
+  if (left_value->getType()->isIntegerTy(64) || right_value->getType()->isIntegerTy(64)) {
+    llvm::Value* left_int = getExactInt(left_value);
+    llvm::Value* right_int = getExactInt(right_value);
+    if (left_int != nullptr && right_int != nullptr) {
+      result = createIntBinaryOp(op_str, left_int, right_int, no_signed_wrap_, double_arithmetic_);
+      if (result != nullptr) {
+        return result;
+      }
+    }
+  }
+  if (left_value->getType()->isIntegerTy(1) && right_value->getType()->isIntegerTy(1)) {
+    if (op_str == "&") {
+      return cur_builder->CreateAnd(left_value, right_value, getTmpName());
+    } else if (op_str == "|") {
+      return cur_builder->CreateOr(left_value, right_value, getTmpName());
+    } else if (op_str == "^") {
+      return cur_builder->CreateXor(left_value, right_value, getTmpName());
+    }
+  }
+  left_value = convertToDouble(left_value);
+  right_value = convertToDouble(right_value);
   if (op_str == "<") {
     result = cur_builder->CreateFCmpOLT(left_value, right_value, getTmpName());
   } else if (op_str == "<=") {
@@ -225,7 +807,7 @@ llvm::Value* BinaryExprAST::codegen() {
   } else if (op_str == ">") {
     result = cur_builder->CreateFCmpOGT(left_value, right_value, getTmpName());
   } else if (op_str == ">=") {
-    result = cur_builder->CreateFCmpOGT(left_value, right_value, getTmpName());
+    result = cur_builder->CreateFCmpOGE(left_value, right_value, getTmpName());
   } else if (op_str == "+") {
     result = cur_builder->CreateFAdd(left_value, right_value, getTmpName());
   } else if (op_str == "-") {
@@ -234,10 +816,14 @@ llvm::Value* BinaryExprAST::codegen() {
     result = cur_builder->CreateFMul(left_value, right_value, getTmpName());
   } else if (op_str == "/") {
     result = cur_builder->CreateFDiv(left_value, right_value, getTmpName());
+  } else if (op_str == "%") {
+    result = cur_builder->CreateFRem(left_value, right_value, getTmpName());
+  } else if (op_str == "&" || op_str == "|" || op_str == "^" || op_str == "<<" ||
+             op_str == ">>") {
+    LOG(FATAL) << "Operator " << op_str << " needs int operands, loc " << getLoc().toString();
   } else {
     LOG(FATAL) << "Unexpected binary operator " << op_str;
   }
-  result = cur_builder->CreateUIToFP(result, llvm::Type::getDoubleTy(*context));
   return result;
 }
 
@@ -245,21 +831,35 @@ llvm::Value* AssignmentExprAST::codegen() {
   debug_info_helper->emitLocation(getLoc());
   llvm::Value* variable = getVariable(var_name_);
   if (variable == nullptr) {
-    variable = createVariable(var_name_, getLoc(), 0);
+    variable = createVariable(var_name_, getLoc(), 0, value_type_);
   }
   CHECK(variable != nullptr);
-  llvm::Value* value = right_->codegen();
-  cur_builder->CreateStore(value, variable);
+  llvm::Type* type = variable->getType()->getPointerElementType();
+  if (has_declared_type_ && type != getLLVMType(value_type_)) {
+    LOG(FATAL) << "Variable " << var_name_ << " is declared as "
+               << getValueTypeName(value_type_) << " with a different type before, loc "
+               << getLoc().toString();
+  }
+  llvm::Value* value = convertToType(right_->codegen(), type);
+  storeVariable(value, variable);
   return value;
 }
 
 llvm::Function* PrototypeAST::codegen() {
   debug_info_helper->emitLocation(getLoc());
-  std::vector<llvm::Type*> doubles(args_.size(), llvm::Type::getDoubleTy(*context));
+  std::vector<llvm::Type*> arg_types;
+  for (auto type : arg_types_) {
+    arg_types.push_back(getLLVMType(type));
+  }
   llvm::FunctionType* function_type =
-      llvm::FunctionType::get(llvm::Type::getDoubleTy(*context), doubles, false);
-  llvm::Function* function =
-      llvm::Function::Create(function_type, llvm::GlobalValue::ExternalLinkage, name_, cur_module);
+      llvm::FunctionType::get(getLLVMType(return_type_), arg_types, false);
+  // A function may be declared before its definition in snapshots.
+  llvm::Function* function = cur_module->getFunction(name_);
+  if (function == nullptr || !function->isDeclaration() ||
+      function->getFunctionType() != function_type) {
+    function = llvm::Function::Create(function_type, llvm::GlobalValue::ExternalLinkage, name_,
+                                      cur_module);
+  }
   auto arg_it = function->arg_begin();
   for (size_t i = 0; i < function->arg_size(); ++i, ++arg_it) {
     arg_it->setName(args_[i]);
@@ -277,13 +877,15 @@ llvm::Function* FunctionAST::codegen() {
   llvm::BasicBlock* basic_block = llvm::BasicBlock::Create(*context, body_label, function);
   llvm::IRBuilder<>::InsertPointGuard InsertPointGuard(*cur_builder);
   cur_builder->SetInsertPoint(basic_block);
+  countBlockEntries();
 
   // Don't allow to break on argument initialization.
   // global_debug_info.emitLocation(nullptr);
 
   auto arg_it = function->arg_begin();
   for (size_t i = 0; i < function->arg_size(); ++i, ++arg_it) {
-    llvm::Value* variable = createVariable(arg_it->getName(), getLoc(), i + 1);
+    llvm::Value* variable =
+        createVariable(arg_it->getName(), getLoc(), i + 1, prototype_->getArgTypes()[i]);
     cur_builder->CreateStore(&*arg_it, variable);
   }
 
@@ -291,19 +893,21 @@ llvm::Function* FunctionAST::codegen() {
 
   llvm::Value* ret_val = body_->codegen();
   CHECK(ret_val != nullptr);
-  cur_builder->CreateRet(ret_val);
+  cur_builder->CreateRet(convertToType(ret_val, function->getReturnType()));
+  finishFunctionProfile(function);
   debug_info_helper->endFunction();
   return function;
 }
 
 llvm::Value* CallExprAST::codegen() {
   debug_info_helper->emitLocation(getLoc());
-  llvm::Function* function = cur_module->getFunction(callee_);
+  llvm::Function* function = getFunction(callee_);
   CHECK(function != nullptr);
   CHECK_EQ(function->arg_size(), args_.size());
+  llvm::FunctionType* function_type = function->getFunctionType();
   std::vector<llvm::Value*> values;
-  for (auto& arg : args_) {
-    llvm::Value* value = arg->codegen();
+  for (size_t i = 0; i < args_.size(); ++i) {
+    llvm::Value* value = convertToType(args_[i]->codegen(), function_type->getParamType(i));
     values.push_back(value);
   }
   return cur_builder->CreateCall(function, values, getTmpName());
@@ -317,21 +921,26 @@ llvm::Value* IfExprAST::codegen() {
   std::vector<llvm::BasicBlock*> then_end_blocks;
   std::vector<llvm::Value*> cond_values;
   std::vector<llvm::Value*> then_values;
+  // Entries of the then block of each condition, and of the block after it.
+  std::vector<size_t> then_counters;
+  std::vector<size_t> next_counters;
 
   for (size_t i = 0; i < cond_then_exprs_.size(); ++i) {
     // Cond block.
     if (i != 0) {
       llvm::BasicBlock* cond_block = llvm::BasicBlock::Create(*context, "if_cond", cur_function);
       cur_builder->SetInsertPoint(cond_block);
+      next_counters.push_back(countBlockEntries());
     }
     cond_begin_blocks.push_back(cur_builder->GetInsertBlock());
-    llvm::Value* cond_value = cond_then_exprs_[i].first->codegen();
+    llvm::Value* cond_value = convertToCondition(cond_then_exprs_[i].first->codegen());
     cond_values.push_back(cond_value);
     cond_end_blocks.push_back(cur_builder->GetInsertBlock());
 
     // Then block.
     llvm::BasicBlock* then_block = llvm::BasicBlock::Create(*context, "if_then", cur_function);
     cur_builder->SetInsertPoint(then_block);
+    then_counters.push_back(countBlockEntries());
     then_begin_blocks.push_back(cur_builder->GetInsertBlock());
     llvm::Value* then_value = cond_then_exprs_[i].second->codegen();
     then_values.push_back(then_value);
@@ -340,36 +949,50 @@ llvm::Value* IfExprAST::codegen() {
   // Else block.
   llvm::BasicBlock* else_begin_block = llvm::BasicBlock::Create(*context, "if_else", cur_function);
   cur_builder->SetInsertPoint(else_begin_block);
+  next_counters.push_back(countBlockEntries());
   llvm::Value* else_value = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
   if (else_expr_ != nullptr) {
     else_value = else_expr_->codegen();
   }
   llvm::BasicBlock* else_end_block = cur_builder->GetInsertBlock();
 
+  // The result is int if all the branches are int, otherwise it is double.
+  std::vector<llvm::Value*> values = then_values;
+  values.push_back(else_value);
+  llvm::Type* result_type = llvm::Type::getInt64Ty(*context);
+  bool has_int_value = false;
+  for (auto value : values) {
+    if (value->getType()->isIntegerTy(64)) {
+      has_int_value = true;
+    } else if (getExactInt(value) == nullptr) {
+      result_type = llvm::Type::getDoubleTy(*context);
+    }
+  }
+  if (!has_int_value) {
+    result_type = llvm::Type::getDoubleTy(*context);
+  }
+
   llvm::BasicBlock* merge_block = llvm::BasicBlock::Create(*context, "if_endif", cur_function);
 
   // Fix up branches.
   for (size_t i = 0; i < cond_then_exprs_.size(); ++i) {
     cur_builder->SetInsertPoint(cond_end_blocks[i]);
-    llvm::Value* cmp_value = cond_values[i];
-    if (cmp_value->getType() == llvm::Type::getDoubleTy(*context)) {
-      cmp_value = cur_builder->CreateFCmpONE(cond_values[i],
-                                             llvm::ConstantFP::get(*context, llvm::APFloat(0.0)));
-    }
-    cur_builder->CreateCondBr(
-        cmp_value, then_begin_blocks[i],
-        (i + 1 < cond_then_exprs_.size() ? cond_begin_blocks[i + 1] : else_begin_block));
+    createCondBr(cond_values[i], then_begin_blocks[i], then_counters[i],
+                 (i + 1 < cond_then_exprs_.size() ? cond_begin_blocks[i + 1] : else_begin_block),
+                 next_counters[i]);
 
     cur_builder->SetInsertPoint(then_end_blocks[i]);
+    then_values[i] = convertToType(then_values[i], result_type);
     cur_builder->CreateBr(merge_block);
   }
 
   cur_builder->SetInsertPoint(else_end_block);
+  else_value = convertToType(else_value, result_type);
   cur_builder->CreateBr(merge_block);
 
   cur_builder->SetInsertPoint(merge_block);
-  llvm::PHINode* phi_node = cur_builder->CreatePHI(llvm::Type::getDoubleTy(*context),
-                                                   cond_then_exprs_.size() + 1, "iftmp");
+  llvm::PHINode* phi_node =
+      cur_builder->CreatePHI(result_type, cond_then_exprs_.size() + 1, "iftmp");
   for (size_t i = 0; i < cond_then_exprs_.size(); ++i) {
     phi_node->addIncoming(then_values[i], then_end_blocks[i]);
   }
@@ -386,8 +1009,181 @@ llvm::Value* BlockExprAST::codegen() {
   return last_value;
 }
 
+// The names of a parallel loop must refer to the same variables as in the sequential loop. The
+// index and the variables created by the body don't exist before the loop, reductions are double
+// variables, and captured variables exist.
+static bool canRunInParallel(const ParallelLoop& loop) {
+  if (getVariable(loop.index_name) != nullptr) {
+    return false;
+  }
+  for (auto& name : loop.body_variables) {
+    if (getVariable(name) != nullptr) {
+      return false;
+    }
+  }
+  for (auto& name : loop.reductions) {
+    llvm::Value* variable = getVariable(name);
+    if (variable == nullptr || !variable->getType()->getPointerElementType()->isDoubleTy()) {
+      return false;
+    }
+  }
+  for (auto& name : loop.captured_variables) {
+    if (getVariable(name) == nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Create a local variable in the current scope holding value.
+static llvm::Value* createLocalCopy(const std::string& name, llvm::Value* value,
+                                    SourceLocation loc) {
+  llvm::AllocaInst* variable = createEntryBlockAlloca(value->getType(), name);
+  debug_info_helper->createLocalVariable(variable, loc, 0);
+  cur_builder->CreateStore(value, variable);
+  cur_scope->insertVariable(name, variable);
+  return variable;
+}
+
+// Generate void body(i8* env, i64 begin, i64 end, double* partial_sums), running the iterations
+// with index values in [begin, end). Captured variables are copied from env. Reductions start
+// from -0.0, so adding the partial sum of no iterations keeps a variable unchanged.
+static llvm::Function* createParallelLoopBody(const ParallelLoop& loop, llvm::StructType* env_type,
+                                              SourceLocation loc) {
+  llvm::Type* int_type = llvm::Type::getInt64Ty(*context);
+  llvm::Type* double_type = llvm::Type::getDoubleTy(*context);
+  std::vector<llvm::Type*> arg_types;
+  arg_types.push_back(llvm::Type::getInt8PtrTy(*context));
+  arg_types.push_back(int_type);
+  arg_types.push_back(int_type);
+  arg_types.push_back(double_type->getPointerTo());
+  llvm::Function* function = llvm::Function::Create(
+      llvm::FunctionType::get(llvm::Type::getVoidTy(*context), arg_types, false),
+      llvm::GlobalValue::InternalLinkage, "__toy_parallel_body", cur_module);
+  CurFunctionGuard guard(function);
+  debug_info_helper->createFunction(function, loc, true);
+  llvm::IRBuilder<>::InsertPointGuard insert_point_guard(*cur_builder);
+  cur_builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "parallel_entry", function));
+  debug_info_helper->emitLocation(loc);
+  auto arg_it = function->arg_begin();
+  llvm::Value* env = &*arg_it++;
+  llvm::Value* begin = &*arg_it++;
+  llvm::Value* end = &*arg_it++;
+  llvm::Value* partial_sums = &*arg_it;
+
+  llvm::Value* env_pointer = cur_builder->CreateBitCast(env, env_type->getPointerTo());
+  for (size_t i = 0; i < loop.captured_variables.size(); ++i) {
+    llvm::Value* field = cur_builder->CreateStructGEP(env_type, env_pointer, i);
+    createLocalCopy(loop.captured_variables[i], cur_builder->CreateLoad(field, getTmpName()), loc);
+  }
+  std::vector<llvm::Value*> reductions;
+  for (auto& name : loop.reductions) {
+    reductions.push_back(createLocalCopy(name, llvm::ConstantFP::get(double_type, -0.0), loc));
+  }
+  llvm::Value* index = createLocalCopy(loop.index_name, begin, loc);
+
+  llvm::BasicBlock* cmp_block = llvm::BasicBlock::Create(*context, "parallel_cmp", function);
+  llvm::BasicBlock* loop_block = llvm::BasicBlock::Create(*context, "parallel_loop", function);
+  llvm::BasicBlock* after_loop_block =
+      llvm::BasicBlock::Create(*context, "parallel_after_loop", function);
+  cur_builder->CreateBr(cmp_block);
+  cur_builder->SetInsertPoint(cmp_block);
+  llvm::Value* cond_value =
+      cur_builder->CreateICmpSLT(cur_builder->CreateLoad(index, getTmpName()), end, getTmpName());
+  cur_builder->CreateCondBr(cond_value, loop_block, after_loop_block);
+
+  cur_builder->SetInsertPoint(loop_block);
+  loop.body->codegen();
+  debug_info_helper->emitLocation(loc);
+  // Indexes stay within 2^53 plus a step, see __toy_parallel_for.
+  llvm::Value* step = llvm::ConstantInt::get(int_type, loop.step);
+  llvm::Value* next_index = cur_builder->CreateAdd(cur_builder->CreateLoad(index, getTmpName()),
+                                                   step, getTmpName(), false, true);
+  cur_builder->CreateStore(next_index, index);
+  cur_builder->CreateBr(cmp_block);
+
+  cur_builder->SetInsertPoint(after_loop_block);
+  for (size_t i = 0; i < reductions.size(); ++i) {
+    cur_builder->CreateStore(cur_builder->CreateLoad(reductions[i], getTmpName()),
+                             cur_builder->CreateConstInBoundsGEP1_64(partial_sums, i));
+  }
+  cur_builder->CreateRetVoid();
+  debug_info_helper->endFunction();
+  return function;
+}
+
+// Run the loop with __toy_parallel_for(body, env, begin, end, inclusive, step, reductions,
+// reduction_count) in supportlib. The values of captured variables are passed in env, and the
+// reductions are read from and written back to an array.
+static llvm::Value* createParallelLoop(const ParallelLoop& loop, SourceLocation loc) {
+  llvm::Type* int_type = llvm::Type::getInt64Ty(*context);
+  llvm::Type* double_type = llvm::Type::getDoubleTy(*context);
+  std::vector<llvm::Value*> captured_values;
+  std::vector<llvm::Type*> captured_types;
+  for (auto& name : loop.captured_variables) {
+    captured_values.push_back(loadVariable(getVariable(name)));
+    captured_types.push_back(captured_values.back()->getType());
+  }
+  llvm::Value* end_value = convertToDouble(loop.end->codegen());
+  debug_info_helper->emitLocation(loc);
+  llvm::StructType* env_type = llvm::StructType::get(*context, captured_types);
+  llvm::Value* env = createEntryBlockAlloca(env_type, "parallel_env");
+  for (size_t i = 0; i < captured_values.size(); ++i) {
+    cur_builder->CreateStore(captured_values[i], cur_builder->CreateStructGEP(env_type, env, i));
+  }
+  llvm::Value* reductions = createEntryBlockAlloca(
+      llvm::ArrayType::get(double_type, loop.reductions.size()), "parallel_reductions");
+  for (size_t i = 0; i < loop.reductions.size(); ++i) {
+    cur_builder->CreateStore(loadVariable(getVariable(loop.reductions[i])),
+                             cur_builder->CreateConstInBoundsGEP2_64(reductions, 0, i));
+  }
+  llvm::Function* body = createParallelLoopBody(loop, env_type, loc);
+  debug_info_helper->emitLocation(loc);
+
+  llvm::Function* parallel_for = cur_module->getFunction(toy_parallel_for_function_name);
+  if (parallel_for == nullptr) {
+    std::vector<llvm::Type*> arg_types;
+    arg_types.push_back(body->getType());
+    arg_types.push_back(llvm::Type::getInt8PtrTy(*context));
+    arg_types.push_back(int_type);
+    arg_types.push_back(double_type);
+    arg_types.push_back(int_type);
+    arg_types.push_back(int_type);
+    arg_types.push_back(double_type->getPointerTo());
+    arg_types.push_back(int_type);
+    parallel_for = llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*context), arg_types, false),
+        llvm::GlobalValue::ExternalLinkage, toy_parallel_for_function_name, cur_module);
+  }
+  std::vector<llvm::Value*> args;
+  args.push_back(body);
+  args.push_back(cur_builder->CreateBitCast(env, llvm::Type::getInt8PtrTy(*context)));
+  args.push_back(llvm::ConstantInt::get(int_type, loop.begin, true));
+  args.push_back(end_value);
+  args.push_back(llvm::ConstantInt::get(int_type, loop.inclusive_end ? 1 : 0));
+  args.push_back(llvm::ConstantInt::get(int_type, loop.step));
+  args.push_back(cur_builder->CreateConstInBoundsGEP2_64(reductions, 0, 0));
+  args.push_back(llvm::ConstantInt::get(int_type, loop.reductions.size()));
+  cur_builder->CreateCall(parallel_for, args);
+  for (size_t i = 0; i < loop.reductions.size(); ++i) {
+    llvm::Value* sum =
+        cur_builder->CreateLoad(cur_builder->CreateConstInBoundsGEP2_64(reductions, 0, i));
+    storeVariable(sum, getVariable(loop.reductions[i]));
+  }
+  return llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+}
+
 llvm::Value* ForExprAST::codegen() {
   debug_info_helper->emitLocation(getLoc());
+  auto parallel_it = parallel_loops.find(this);
+  if (parallel_it != parallel_loops.end()) {
+    if (canRunInParallel(parallel_it->second)) {
+      LOG(DEBUG) << "run loop in parallel, loc " << getLoc().toString();
+      return createParallelLoop(parallel_it->second, getLoc());
+    }
+    LOG(DEBUG) << "loop variables exist before it, run it sequentially, loc "
+               << getLoc().toString();
+  }
   // Init block.
   ScopeGuard scoped_guard_init;
   init_expr_->codegen();
@@ -396,12 +1192,13 @@ llvm::Value* ForExprAST::codegen() {
   // Cmp block.
   llvm::BasicBlock* cmp_begin_block = llvm::BasicBlock::Create(*context, "for_cmp", cur_function);
   cur_builder->SetInsertPoint(cmp_begin_block);
-  llvm::Value* cond_value = cond_expr_->codegen();
+  llvm::Value* cond_value = convertToCondition(cond_expr_->codegen());
   llvm::BasicBlock* cmp_end_block = cur_builder->GetInsertBlock();
 
   // Loop block.
   llvm::BasicBlock* loop_begin_block = llvm::BasicBlock::Create(*context, "for_loop", cur_function);
   cur_builder->SetInsertPoint(loop_begin_block);
+  size_t loop_counter = countBlockEntries();
   block_expr_->codegen();
   next_expr_->codegen();
   llvm::BasicBlock* loop_end_block = cur_builder->GetInsertBlock();
@@ -409,17 +1206,14 @@ llvm::Value* ForExprAST::codegen() {
   // After loop block.
   llvm::BasicBlock* after_loop_block =
       llvm::BasicBlock::Create(*context, "for_after_loop", cur_function);
+  cur_builder->SetInsertPoint(after_loop_block);
+  size_t after_loop_counter = countBlockEntries();
 
   // Fix branches.
   cur_builder->SetInsertPoint(init_end_block);
   cur_builder->CreateBr(cmp_begin_block);
   cur_builder->SetInsertPoint(cmp_end_block);
-  llvm::Value* cmp_value = cond_value;
-  if (cmp_value->getType() == llvm::Type::getDoubleTy(*context)) {
-    cmp_value =
-        cur_builder->CreateFCmpONE(cond_value, llvm::ConstantFP::get(*context, llvm::APFloat(0.0)));
-  }
-  cur_builder->CreateCondBr(cmp_value, loop_begin_block, after_loop_block);
+  createCondBr(cond_value, loop_begin_block, loop_counter, after_loop_block, after_loop_counter);
 
   cur_builder->SetInsertPoint(loop_end_block);
   cur_builder->CreateBr(cmp_begin_block);
@@ -428,6 +1222,12 @@ llvm::Value* ForExprAST::codegen() {
   return llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
 }
 
+llvm::Value* CommandAST::codegen() {
+  CHECK(command_ == COMMAND_JOB) << "Command generates no code, loc " << getLoc().toString();
+  debug_info_helper->emitLocation(getLoc());
+  return expr_->codegen();
+}
+
 static llvm::Function* createTmpFunction(const std::string& function_name, SourceLocation loc,
                                          bool is_local) {
   llvm::FunctionType* function_type =
@@ -444,7 +1244,13 @@ void prepareCodePipeline() {
   context = &llvm::getGlobalContext();
   cur_builder.reset(new llvm::IRBuilder<>(*context));
   extern_functions.clear();
-  extern_variables.clear();
+  for (auto prototype : prelude_functions) {
+    extern_functions[prototype->getName()] = prototype;
+  }
+  function_definitions.clear();
+  global_variables.clear();
+  global_variable_slots.clear();
+  extern_string_literals.clear();
   global_scope.reset(new Scope(nullptr));
   cur_scope = global_scope.get();
 }
@@ -459,11 +1265,37 @@ static void addFunctionDeclarationsInSupportLib(llvm::LLVMContext* context, llvm
   v[0] = double_type;
   llvm::FunctionType* printd_function_type = llvm::FunctionType::get(double_type, v, false);
   llvm::Function::Create(printd_function_type, llvm::GlobalValue::ExternalLinkage, "printd", module);
+  llvm::Function::Create(printd_function_type, llvm::GlobalValue::ExternalLinkage,
+                         toy_result_function_name, module);
 }
 
-static std::unique_ptr<llvm::Module> codePipeline(const std::vector<ExprAST*>& exprs) {
+// In pipeline mode, the module may be freed on another thread once it is returned, so nothing
+// here refers to its context any more.
+static void releaseModuleContext() {
+  if (global_option.pipeline) {
+    debug_info_helper.reset(nullptr);
+    cur_builder.reset(nullptr);
+    context = nullptr;
+  }
+}
+
+void deleteModule(llvm::Module* module) {
+  llvm::LLVMContext* module_context = &module->getContext();
+  delete module;
+  if (global_option.pipeline) {
+    delete module_context;
+  }
+}
+
+std::unique_ptr<llvm::Module> codePipeline(const std::vector<ExprAST*>& exprs) {
+  if (global_option.pipeline) {
+    context = new llvm::LLVMContext;
+    cur_builder.reset(new llvm::IRBuilder<>(*context));
+  }
   std::unique_ptr<llvm::Module> module(new llvm::Module(getTmpModuleName(), *context));
   cur_module = module.get();
+  module_string_literals.clear();
+  module_global_variables.clear();
   debug_info_helper.reset(
       new DebugInfoHelper(cur_builder.get(), cur_module, global_option.input_file));
 
@@ -472,19 +1304,20 @@ static std::unique_ptr<llvm::Module> codePipeline(const std::vector<ExprAST*>& e
   global_function = createTmpFunction(toy_main_function_name, loc, is_local);
   cur_builder->SetInsertPoint(&global_function->back());
   cur_function = global_function;
+  function_profiles.clear();
+  function_profile_indexes.clear();
+  countBlockEntries();
   llvm::Value* ret_value = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
 
-  for (auto& name : extern_variables) {
-    new llvm::GlobalVariable(*cur_module, llvm::Type::getDoubleTy(*context), false,
-                             llvm::GlobalVariable::ExternalLinkage, nullptr, name);
-  }
-
-  for (auto expr : extern_functions) {
-    expr->codegen();
-  }
   addFunctionDeclarationsInSupportLib(context, cur_module);
-  for (auto expr : exprs) {
+  std::vector<size_t> global_variable_counts;
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    ExprAST* expr = exprs[i];
+    global_variable_counts.push_back(global_variables.size());
     llvm::Value* value = expr->codegen();
+    if (global_option.interactive) {
+      ret_value = llvm::ConstantFP::get(*context, llvm::APFloat(0.0));
+    }
     switch (expr->type()) {
       case NUMBER_EXPR_AST:
       case VARIABLE_EXPR_AST:
@@ -494,29 +1327,53 @@ static std::unique_ptr<llvm::Module> codePipeline(const std::vector<ExprAST*>& e
       case CALL_EXPR_AST:
       case IF_EXPR_AST:
       case BLOCK_EXPR_AST:
-      case FOR_EXPR_AST: {
+      case FOR_EXPR_AST:
+      case COMMAND_AST: {
         ret_value = value;
         break;
       }
       default:
         break;
     }
+    // Statements read together in interactive mode are compiled in one module. Each statement
+    // but the last prints its result as it finishes, like it would in a module of its own.
+    if (global_option.interactive && i + 1 < exprs.size()) {
+      cur_builder->CreateCall(cur_module->getFunction(toy_result_function_name),
+                              std::vector<llvm::Value*>(1, convertToDouble(ret_value)));
+    }
   }
-  for (auto expr : exprs) {
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    ExprAST* expr = exprs[i];
     switch (expr->type()) {
-      case PROTOTYPE_AST:
-        extern_functions.push_back(reinterpret_cast<PrototypeAST*>(expr));
+      case PROTOTYPE_AST: {
+        PrototypeAST* prototype = reinterpret_cast<PrototypeAST*>(expr);
+        extern_functions[prototype->getName()] = prototype;
         break;
+      }
       case FUNCTION_AST: {
         FunctionAST* function = reinterpret_cast<FunctionAST*>(expr);
-        extern_functions.push_back(function->getPrototype());
+        PrototypeAST* prototype = function->getPrototype();
+        extern_functions[prototype->getName()] = prototype;
+        function_definitions[prototype->getName()] =
+            FunctionDefinition{function, global_variable_counts[i]};
         break;
       }
       default:
         break;
     }
   }
-  cur_builder->CreateRet(ret_value);
+  if (profile_code && !global_option.profile_generate_file.empty()) {
+    packProfileCounters();
+  }
+  cur_builder->CreateRet(convertToDouble(ret_value));
+  finishFunctionProfile(global_function);
+  function_profiles.clear();
+  function_profile_indexes.clear();
+  if (!global_option.interactive) {
+    packGlobalVariables();
+  } else {
+    makeFreeableStringLiteralsPrivate();
+  }
   debug_info_helper->endFunction();
   debug_info_helper->finalize();
   if (global_option.dump_code) {
@@ -525,11 +1382,15 @@ static std::unique_ptr<llvm::Module> codePipeline(const std::vector<ExprAST*>& e
   cur_function = nullptr;
   global_function = nullptr;
   cur_module = nullptr;
+  module_string_literals.clear();
+  module_global_variables.clear();
+  releaseModuleContext();
   std::string err;
   llvm::raw_string_ostream os(err);
   bool broken = llvm::verifyModule(*module, &os);
   if (broken) {
     LOG(ERROR) << "verify module failed: " << os.str();
+    deleteModule(module.release());
     return nullptr;
   }
   return module;
@@ -539,17 +1400,146 @@ std::unique_ptr<llvm::Module> codePipeline(ExprAST* Expr) {
   return codePipeline(std::vector<ExprAST*>({Expr}));
 }
 
+// All functions are declared first, because a function may call one defined after it. String
+// literals are defined privately in the snapshot, instead of referring to previous modules.
+std::unique_ptr<llvm::Module> codeSnapshotPipeline() {
+  if (global_option.pipeline) {
+    context = new llvm::LLVMContext;
+    cur_builder.reset(new llvm::IRBuilder<>(*context));
+  }
+  std::unique_ptr<llvm::Module> module(new llvm::Module(getTmpModuleName(), *context));
+  cur_module = module.get();
+  module_string_literals.clear();
+  module_global_variables.clear();
+  cur_builder->ClearInsertionPoint();
+  debug_info_helper.reset(
+      new DebugInfoHelper(cur_builder.get(), cur_module, global_option.input_file));
+  addFunctionDeclarationsInSupportLib(context, cur_module);
+
+  std::unordered_map<std::string, std::string> saved_string_literals = extern_string_literals;
+  for (auto& pair : function_definitions) {
+    pair.second.function->getPrototype()->codegen();
+  }
+  for (auto& pair : function_definitions) {
+    visible_global_variables = pair.second.visible_global_variables;
+    pair.second.function->codegen();
+  }
+  visible_global_variables = SIZE_MAX;
+  for (auto& pair : extern_string_literals) {
+    llvm::GlobalVariable* variable = cur_module->getGlobalVariable(pair.second);
+    if (variable != nullptr && variable->isDeclaration()) {
+      variable->setInitializer(llvm::ConstantDataArray::getString(*context, pair.first));
+    }
+  }
+  for (auto& pair : module_string_literals) {
+    pair.second->setLinkage(llvm::GlobalValue::PrivateLinkage);
+    pair.second->setUnnamedAddr(true);
+  }
+  extern_string_literals = saved_string_literals;
+
+  debug_info_helper->finalize();
+  if (global_option.dump_code) {
+    cur_module->dump();
+  }
+  cur_module = nullptr;
+  module_string_literals.clear();
+  module_global_variables.clear();
+  releaseModuleContext();
+  std::string err;
+  llvm::raw_string_ostream os(err);
+  bool broken = llvm::verifyModule(*module, &os);
+  CHECK(!broken) << "verify snapshot module failed: " << os.str();
+  return module;
+}
+
+std::vector<PrototypeAST*> getFunctionPrototypes() {
+  std::vector<PrototypeAST*> prototypes;
+  for (auto& pair : extern_functions) {
+    prototypes.push_back(pair.second);
+  }
+  return prototypes;
+}
+
+const std::vector<std::pair<std::string, ValueType>>& getGlobalVariables() {
+  return global_variables;
+}
+
+void restoreFunctionPrototype(PrototypeAST* prototype) {
+  extern_functions[prototype->getName()] = prototype;
+}
+
+void restoreGlobalVariable(const std::string& name, ValueType type) {
+  global_variable_slots[name] = global_variables.size();
+  global_variables.push_back(std::make_pair(name, type));
+}
+
+void addPreludeFunction(PrototypeAST* prototype) {
+  prelude_functions.push_back(prototype);
+}
+
+// Collect names of all variables read or assigned in function bodies.
+static void collectFunctionVariableNames(ExprAST* expr, bool in_function) {
+  if (expr->type() == FUNCTION_AST) {
+    in_function = true;
+  } else if (in_function && expr->type() == VARIABLE_EXPR_AST) {
+    function_variable_names.insert(reinterpret_cast<VariableExprAST*>(expr)->getName());
+  } else if (in_function && expr->type() == ASSIGNMENT_EXPR_AST) {
+    function_variable_names.insert(reinterpret_cast<AssignmentExprAST*>(expr)->getVarName());
+  }
+  for (auto child : expr->getChildren()) {
+    collectFunctionVariableNames(child, in_function);
+  }
+}
+
 void finishCodePipeline() {
   cur_scope = nullptr;
   global_scope.reset(nullptr);
-  extern_variables.clear();
+  if (global_option.interactive) {
+    memset(__toy_globals, 0, global_variables.size() * toy_global_slot_size);
+  }
+  global_variables.clear();
+  global_variable_slots.clear();
+  extern_string_literals.clear();
   extern_functions.clear();
+  function_definitions.clear();
+  promote_global_variables = false;
+  profile_code = false;
+  function_variable_names.clear();
+  parallel_loops.clear();
   cur_builder.reset(nullptr);
 }
 
 std::unique_ptr<llvm::Module> codeMain(const std::vector<ExprAST*>& exprs) {
   prepareCodePipeline();
+  promote_global_variables = true;
+  profile_code = (!global_option.profile_generate_file.empty() ||
+                  !global_option.profile_use_file.empty());
+  for (auto expr : exprs) {
+    collectFunctionVariableNames(expr, false);
+  }
+  if (global_option.auto_parallel) {
+    parallel_loops = findParallelLoops(exprs);
+  }
   std::unique_ptr<llvm::Module> module = codePipeline(exprs);
   finishCodePipeline();
   return module;
 }
+
+std::unique_ptr<llvm::Module> codePreludeMain(const std::vector<ExprAST*>& exprs) {
+  prepareCodePipeline();
+  for (auto expr : exprs) {
+    if (expr->type() == FUNCTION_AST) {
+      FunctionAST* function = reinterpret_cast<FunctionAST*>(expr);
+      PrototypeAST* prototype = function->getPrototype();
+      extern_functions[prototype->getName()] = prototype;
+      function_definitions[prototype->getName()] = FunctionDefinition{function, 0};
+    } else {
+      CHECK_EQ(PROTOTYPE_AST, expr->type());
+      PrototypeAST* prototype = reinterpret_cast<PrototypeAST*>(expr);
+      extern_functions[prototype->getName()] = prototype;
+    }
+  }
+  std::unique_ptr<llvm::Module> module = codeSnapshotPipeline();
+  finishCodePipeline();
+  return module;
+}
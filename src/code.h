@@ -1,19 +1,46 @@
 #ifndef TOY_CODE_H_
 #define TOY_CODE_H_
 
+#include <string>
+#include <utility>
 #include <vector>
 #include <llvm/IR/Module.h>
 
+#include "parse.h"
+
 class ExprAST;
 
 constexpr const char* toy_main_function_name = "__toy_main";
+constexpr const char* toy_result_function_name = "__toy_result";
+constexpr const char* toy_write_profile_function_name = "__toy_write_profile";
+constexpr const char* toy_parallel_for_function_name = "__toy_parallel_for";
 
 // Used in interactive mode.
 void prepareCodePipeline();
 std::unique_ptr<llvm::Module> codePipeline(ExprAST* expr);
+std::unique_ptr<llvm::Module> codePipeline(const std::vector<ExprAST*>& exprs);
+// Return true if previous modules define or declare the function.
+bool hasFunction(const std::string& name);
+// In pipeline mode, each module is generated in a context of its own, which is deleted with the
+// module. Otherwise only the module is deleted.
+void deleteModule(llvm::Module* module);
+
+// Used by REPL snapshots, see snapshot.h.
+// Generate the latest definitions of all functions in one module.
+std::unique_ptr<llvm::Module> codeSnapshotPipeline();
+std::vector<PrototypeAST*> getFunctionPrototypes();
+const std::vector<std::pair<std::string, ValueType>>& getGlobalVariables();
+// Add functions and global variables of a restored snapshot, in the saved order.
+void restoreFunctionPrototype(PrototypeAST* prototype);
+void restoreGlobalVariable(const std::string& name, ValueType type);
+// Functions of a loaded prelude are declared in each session, see snapshot.h.
+void addPreludeFunction(PrototypeAST* prototype);
 void finishCodePipeline();
 
 // Used in non-interactive mode.
 std::unique_ptr<llvm::Module> codeMain(const std::vector<ExprAST*>& exprs);
+// Generate the functions defined in exprs without a main function. Exprs can only be function
+// definitions and declarations.
+std::unique_ptr<llvm::Module> codePreludeMain(const std::vector<ExprAST*>& exprs);
 
 #endif  // TOY_CODE_H_
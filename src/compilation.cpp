@@ -13,6 +13,7 @@
 
 #include "llvm_version.h"
 #include "logging.h"
+#include "optimization.h"
 #include "option.h"
 #include "strings.h"
 
@@ -43,7 +44,7 @@ bool compileMain(llvm::Module* module, bool is_assembly, const std::string& outp
   }
   std::unique_ptr<llvm::TargetMachine> machine(
       target->createTargetMachine(triple, "", "", llvm::TargetOptions(), llvm::Reloc::Default,
-                                  llvm::CodeModel::Default, llvm::CodeGenOpt::None));
+                                  llvm::CodeModel::Default, getCodeGenOptLevel()));
   if (machine == nullptr) {
     LOG(ERROR) << "failed to create target machine";
     return false;
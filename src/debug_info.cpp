@@ -15,7 +15,8 @@ class DebugInfoHelperImpl {
   void finalize();
   void createFunction(llvm::Function* function, SourceLocation loc, bool is_loal);
   void endFunction();
-  void createGlobalVariable(llvm::GlobalVariable* variable, SourceLocation loc);
+  void createGlobalVariable(const std::string& name, llvm::Type* type, llvm::Constant* address,
+                            SourceLocation loc);
   void createLocalVariable(llvm::AllocaInst* variable, SourceLocation loc, size_t arg_index);
   void emitLocation(SourceLocation loc);
 
@@ -29,6 +30,8 @@ class DebugInfoHelperImpl {
   llvm::DICompileUnit* di_compile_unit;
   llvm::DIFile* di_file;
   llvm::DIBasicType* di_double_type;
+  llvm::DIBasicType* di_int_type;
+  llvm::DIBasicType* di_bool_type;
   std::vector<llvm::DIScope*> di_scope_stack;
 };
 
@@ -38,7 +41,9 @@ DebugInfoHelperImpl::DebugInfoHelperImpl(llvm::IRBuilder<>* ir_builder, llvm::Mo
       di_builder(*module),
       di_compile_unit(nullptr),
       di_file(nullptr),
-      di_double_type(nullptr) {
+      di_double_type(nullptr),
+      di_int_type(nullptr),
+      di_bool_type(nullptr) {
   auto names = splitPath(source_filename);
   di_compile_unit = di_builder.createCompileUnit(llvm::dwarf::DW_LANG_C, names.second, names.first,
                                                  "toy compiler", false, "", 0);
@@ -64,11 +69,12 @@ void DebugInfoHelperImpl::endFunction() {
   popDIScope();
 }
 
-void DebugInfoHelperImpl::createGlobalVariable(llvm::GlobalVariable* variable, SourceLocation loc) {
-  LOG(DEBUG) << "createGlobalVariable " << variable->getName().str();
-  di_builder.createGlobalVariable(di_compile_unit, variable->getName(), "", di_file, loc.line,
-                                  getDIType(variable->getValueType(), loc), false, variable);
-  LOG(DEBUG) << "createGlobalVariable " << variable->getName().str() << " end";
+void DebugInfoHelperImpl::createGlobalVariable(const std::string& name, llvm::Type* type,
+                                               llvm::Constant* address, SourceLocation loc) {
+  LOG(DEBUG) << "createGlobalVariable " << name;
+  di_builder.createGlobalVariable(di_compile_unit, name, "", di_file, loc.line,
+                                  getDIType(type, loc), false, address);
+  LOG(DEBUG) << "createGlobalVariable " << name << " end";
 }
 
 void DebugInfoHelperImpl::createLocalVariable(llvm::AllocaInst* variable, SourceLocation loc,
@@ -92,6 +98,11 @@ void DebugInfoHelperImpl::createLocalVariable(llvm::AllocaInst* variable, Source
 }
 
 void DebugInfoHelperImpl::emitLocation(SourceLocation loc) {
+  // Snapshot modules have no __toy_main, so prototypes can be generated out of any function.
+  if (di_scope_stack.empty()) {
+    ir_builder->SetCurrentDebugLocation(llvm::DebugLoc());
+    return;
+  }
   ir_builder->SetCurrentDebugLocation(
       llvm::DebugLoc::get(loc.line, loc.column, di_scope_stack.back()));
 }
@@ -103,10 +114,28 @@ llvm::DIType* DebugInfoHelperImpl::getDIType(llvm::Type* type, SourceLocation de
     }
     return di_double_type;
   }
+  if (type->isIntegerTy(64)) {
+    if (di_int_type == nullptr) {
+      di_int_type = di_builder.createBasicType("int", 64, 64, llvm::dwarf::DW_ATE_signed);
+    }
+    return di_int_type;
+  }
+  if (type->isIntegerTy(1)) {
+    if (di_bool_type == nullptr) {
+      di_bool_type = di_builder.createBasicType("bool", 8, 8, llvm::dwarf::DW_ATE_boolean);
+    }
+    return di_bool_type;
+  }
+  // Pointers are only arguments of generated functions, like bodies of parallel loops.
+  if (type->isPointerTy()) {
+    return di_builder.createPointerType(nullptr, 64, 64);
+  }
   if (type->isFunctionTy()) {
     llvm::FunctionType* func_type = llvm::dyn_cast<llvm::FunctionType>(type);
     std::vector<llvm::Metadata*> di_param_types;
-    di_param_types.push_back(getDIType(func_type->getReturnType(), debug_loc));
+    // Void is described by null.
+    llvm::Type* return_type = func_type->getReturnType();
+    di_param_types.push_back(return_type->isVoidTy() ? nullptr : getDIType(return_type, debug_loc));
     for (auto it = func_type->param_begin(); it != func_type->param_end(); ++it) {
       di_param_types.push_back(getDIType(*it, debug_loc));
     }
@@ -161,9 +190,10 @@ void DebugInfoHelper::endFunction() {
   }
 }
 
-void DebugInfoHelper::createGlobalVariable(llvm::GlobalVariable* variable, SourceLocation loc) {
+void DebugInfoHelper::createGlobalVariable(const std::string& name, llvm::Type* type,
+                                           llvm::Constant* address, SourceLocation loc) {
   if (impl) {
-    impl->createGlobalVariable(variable, loc);
+    impl->createGlobalVariable(name, type, address, loc);
   }
 }
 
@@ -18,7 +18,8 @@ class DebugInfoHelper {
   void finalize();
   void createFunction(llvm::Function* function, SourceLocation loc, bool is_loal);
   void endFunction();
-  void createGlobalVariable(llvm::GlobalVariable* variable, SourceLocation loc);
+  void createGlobalVariable(const std::string& name, llvm::Type* type, llvm::Constant* address,
+                            SourceLocation loc);
   void createLocalVariable(llvm::AllocaInst* variable, SourceLocation loc, size_t arg_index);
   void emitLocation(SourceLocation loc);
 
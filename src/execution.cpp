@@ -1,62 +1,1158 @@
 #include "execution.h"
 
+#include <inttypes.h>
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <llvm/Bitcode/ReaderWriter.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/GenericValue.h>
-#include <llvm/ExecutionEngine/Interpreter.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LambdaResolver.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/ExecutionEngine/RuntimeDyld.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Mangler.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include "blocking_queue.h"
 #include "code.h"
 #include "logging.h"
+#include "optimization.h"
 #include "option.h"
+#include "strings.h"
 
-static std::unique_ptr<llvm::ExecutionEngine> engine;
+// Function bodies in snapshot objects are renamed with the suffix, and called through stubs.
+static const char snapshot_body_suffix[] = ".snapshot";
 
-void prepareExecutionPipeline() {
+class LockedStubsManager;
+
+// Shared by the stubs managers of the modules compiled on demand, see LockedStubsManager.
+struct LazyCompiler {
+  explicit LazyCompiler(std::recursive_mutex* mutex)
+      : mutex(mutex), compile_time(0), layer_callbacks(nullptr) {
+  }
+
+  std::recursive_mutex* mutex;
+  // Total time spent compiling functions on demand.
+  std::chrono::steady_clock::duration compile_time;
+  // Callbacks of CompileOnDemandLayer, which compile a function and point its stub to it.
+  llvm::orc::JITCompileCallbackManager* layer_callbacks;
+  // Callbacks the stubs point to instead, which run the callbacks of the layer with the lock
+  // held.
+  std::unique_ptr<llvm::orc::JITCompileCallbackManager> locked_callbacks;
+  // Stubs managers of the modules in use.
+  std::set<LockedStubsManager*> stubs_managers;
+};
+
+// Bytes allocated by the JIT for a module. Metadata is unwind and debug info.
+struct JITMemoryUsage {
+  JITMemoryUsage() : code_bytes(0), data_bytes(0), metadata_bytes(0) {
+  }
+
+  void add(const JITMemoryUsage& other) {
+    code_bytes += other.code_bytes;
+    data_bytes += other.data_bytes;
+    metadata_bytes += other.metadata_bytes;
+  }
+
+  uint64_t code_bytes;
+  uint64_t data_bytes;
+  uint64_t metadata_bytes;
+};
+
+// Counts the sections allocated for a module, including functions compiled lazily later. The
+// memory is released when the module is removed and its memory manager destroyed.
+class CountingMemoryManager : public llvm::SectionMemoryManager {
+ public:
+  explicit CountingMemoryManager(std::shared_ptr<JITMemoryUsage> usage) : usage_(usage) {
+  }
+
+  uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment, unsigned section_id,
+                               llvm::StringRef section_name) override {
+    usage_->code_bytes += size;
+    return llvm::SectionMemoryManager::allocateCodeSection(size, alignment, section_id,
+                                                           section_name);
+  }
+
+  uint8_t* allocateDataSection(uintptr_t size, unsigned alignment, unsigned section_id,
+                               llvm::StringRef section_name, bool is_read_only) override {
+    if (section_name.startswith(".eh_frame") || section_name.startswith(".debug")) {
+      usage_->metadata_bytes += size;
+    } else {
+      usage_->data_bytes += size;
+    }
+    return llvm::SectionMemoryManager::allocateDataSection(size, alignment, section_id,
+                                                           section_name, is_read_only);
+  }
+
+ private:
+  std::shared_ptr<JITMemoryUsage> usage_;
+};
+
+// In tiered mode, hot functions are queued by JIT code, and compiled on the tier up thread.
+static std::unique_ptr<BlockingQueue<uint64_t>> tier_up_queue;
+static std::thread tier_up_thread;
+
+static void requestTierUp(uint64_t id) {
+  tier_up_queue->push(id);
+}
+
+// The module is written once when it is added, and shared by its tiered functions. Most
+// functions never get hot, so the function is only extracted from it on tier up.
+static std::shared_ptr<const std::string> getModuleBitcode(llvm::Module* module) {
+  std::string bitcode;
+  llvm::raw_string_ostream os(bitcode);
+  llvm::WriteBitcodeToFile(module, os);
+  os.flush();
+  return std::make_shared<const std::string>(std::move(bitcode));
+}
+
+// Only keep the definition of the function in the module. Other functions and global variables
+// are declared, so they are linked to the stubs and variables in the JIT.
+static void keepOnlyFunction(llvm::Module* module, const std::string& name) {
+  for (auto& other : *module) {
+    if (!other.isDeclaration() && other.getName() != name) {
+      other.deleteBody();
+    }
+  }
+  for (auto& variable : module->globals()) {
+    if (!variable.isDeclaration() && !variable.hasLocalLinkage()) {
+      variable.setInitializer(nullptr);
+      variable.setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+  }
+}
+
+// Count calls at the entry of the function and loop iterations at back edges, and request the
+// tier up when the count reaches the threshold.
+static void instrumentFunction(llvm::Function* function, uint64_t id) {
+  llvm::Module* module = function->getParent();
+  llvm::IntegerType* int64_type = llvm::Type::getInt64Ty(module->getContext());
+  llvm::GlobalVariable* counter = new llvm::GlobalVariable(
+      *module, int64_type, false, llvm::GlobalValue::PrivateLinkage,
+      llvm::ConstantInt::get(int64_type, 0), function->getName() + ".count");
+  llvm::FunctionType* callback_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(module->getContext()), std::vector<llvm::Type*>(1, int64_type), false);
+  llvm::Constant* callback = llvm::ConstantExpr::getIntToPtr(
+      llvm::ConstantInt::get(int64_type, reinterpret_cast<uintptr_t>(&requestTierUp)),
+      callback_type->getPointerTo());
+
+  // Allocas stay in the entry block, so they are still static.
+  std::vector<llvm::Instruction*> points;
+  auto entry_point = function->getEntryBlock().begin();
+  while (llvm::isa<llvm::AllocaInst>(&*entry_point)) {
+    ++entry_point;
+  }
+  points.push_back(&*entry_point);
+  llvm::DominatorTree dominator_tree(*function);
+  for (auto& basic_block : *function) {
+    llvm::TerminatorInst* terminator = basic_block.getTerminator();
+    for (unsigned i = 0; i < terminator->getNumSuccessors(); ++i) {
+      if (dominator_tree.dominates(terminator->getSuccessor(i), &basic_block)) {
+        points.push_back(terminator);
+        break;
+      }
+    }
+  }
+  for (auto point : points) {
+    llvm::IRBuilder<> builder(point);
+    // Jobs may run the function at the same time.
+    llvm::Value* count = builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter,
+                                                 builder.getInt64(1), llvm::Monotonic);
+    llvm::Value* reached =
+        builder.CreateICmpEQ(count, builder.getInt64(global_option.tier_up_threshold - 1));
+    builder.SetInsertPoint(llvm::SplitBlockAndInsertIfThen(reached, point, false));
+    builder.CreateCall(callback, std::vector<llvm::Value*>(1, builder.getInt64(id)));
+  }
+}
+
+// The JIT compiles each function the first time it is called. Functions in added modules are
+// replaced by stubs, which call back into the JIT to compile the function body on first call.
+//
+// Each toy function is also called through a stub of its own name, and its body is renamed to
+// name.N. Redefining the function only points the stub to the new body, and frees the module
+// of the old body if nothing else in it can be used. If jobs are running, the old body may still
+// be running in them, so the module is retired instead, and freed when these jobs have finished.
+// A module with only a main function is freed after the main function returns.
+//
+// In tiered mode, code is compiled at -O0 first, and each toy function counts its calls and loop
+// iterations. A hot function is recompiled at -O3 on the tier up thread, from the bitcode of its
+// module written before counting, and its stub is pointed to the new body. The old body may
+// still be running, so it is kept until the function is redefined. A running __toy_main isn't
+// replaced, so loops at the top level stay at -O0.
+//
+// JIT operations hold a lock, because hot functions are linked on the tier up thread, see
+// LockedStubsManager for lazy compilation. Functions are only compiled lazily on the thread
+// adding modules, because the IR of the modules may share the context of code generation. So
+// while jobs run JIT code on other threads, all functions are compiled when modules are added.
+//
+// In pipeline mode, a module is compiled to an object on the optimization thread while the
+// previous module runs, see addCompiledModule(). Compiling doesn't use the JIT, so it is done
+// without the lock. Modules and objects linked into the JIT are identified by ids.
+class ToyJIT {
+ public:
+  typedef llvm::orc::ObjectLinkingLayer<> ObjectLayer;
+  typedef llvm::orc::IRCompileLayer<ObjectLayer> CompileLayer;
+  typedef llvm::orc::CompileOnDemandLayer<CompileLayer> CompileOnDemandLayer;
+  typedef CompileOnDemandLayer::ModuleSetHandleT ModuleHandle;
+
+  ToyJIT();
+  ~ToyJIT();
+  const llvm::DataLayout& getDataLayout() const {
+    return data_layout_;
+  }
+  // Add the module, whose functions are compiled on demand, and define its functions.
+  uint64_t addModule(std::unique_ptr<llvm::Module> module);
+  // Compile the module into an object and link it. Functions defined for the first time are
+  // defined at once, but the stubs of functions it redefines are only pointed to it by
+  // defineFunctions(), so code running meanwhile still calls the old bodies.
+  uint64_t addCompiledModule(std::unique_ptr<llvm::Module> module);
+  // Define the functions a module from addCompiledModule() redefines.
+  void defineFunctions(uint64_t module_id);
+  // Compile the module into an object whose functions are called through stubs, and return
+  // the names of the functions it defines.
+  std::string compileObject(llvm::Module* module, std::vector<std::string>* functions);
+  // Link an object from compileObject(), and point the stubs of its functions to it.
+  void addObject(llvm::StringRef object, const std::vector<std::string>& functions);
+  // Free the module if it only has a main function, which has returned.
+  void releaseMainModule(uint64_t module_id);
+  // Recompile the hot function at -O3 in the context, and point its stub to the new body.
+  // It is called on the tier up thread.
+  void tierUp(uint64_t id, llvm::LLVMContext* context);
+  // Drop hot functions not recompiled yet.
+  void cancelTierUps() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    tiered_functions_.clear();
+  }
+  // Print the memory of modules in use and freed, and of each module in use.
+  void printMemoryUsage(FILE* fp);
+  // Find a symbol defined in the module, or return 0.
+  llvm::orc::TargetAddress getSymbolAddress(uint64_t module_id, const std::string& name);
+  // Set the jobs running JIT code, and free the retired modules no running job may use.
+  void setRunningJobs(const std::set<uint64_t>& jobs);
+  // Compile all functions not compiled yet when a module is added, so jobs never compile.
+  void setCompileEagerly(bool eagerly) {
+    compile_eagerly_ = eagerly;
+  }
+  // Total time spent compiling functions on their first call.
+  std::chrono::steady_clock::duration getLazyCompileTime() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    return lazy_compiler_.compile_time;
+  }
+
+ private:
+  struct Definition {
+    uint64_t module_id;
+    bool removable;
+  };
+
+  // A function a module from addCompiledModule() redefines when it runs.
+  struct PendingDefinition {
+    std::string name;
+    Definition definition;
+    llvm::orc::TargetAddress address;
+  };
+
+  // A module of a redefined function, which the jobs running at the redefinition may still use.
+  struct RetiredModule {
+    uint64_t module_id;
+    std::set<uint64_t> jobs;
+  };
+
+  // A module or an object linked into the JIT. Objects of snapshots and preludes are never
+  // removed. Objects of hot functions recompiled from a module are removed with it, and their
+  // memory counted in it.
+  struct LinkedModule {
+    LinkedModule() : id(0), is_object(false), is_compiled(false), is_main_only(false) {
+    }
+
+    uint64_t id;
+    bool is_object;
+    // Set for modules from addCompiledModule(), linked as object_handle. Other modules are
+    // compiled on demand, and linked as handle.
+    bool is_compiled;
+    ModuleHandle handle;
+    ObjectLayer::ObjSetHandleT object_handle;
+    bool is_main_only;
+    std::shared_ptr<JITMemoryUsage> usage;
+    std::vector<ObjectLayer::ObjSetHandleT> tier_up_objects;
+    // In pipeline mode, the context of a module compiled on demand, deleted after the module.
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::vector<PendingDefinition> pending_definitions;
+  };
+
+  // A function compiled at -O0, and the bitcode of its module it is recompiled from when it
+  // gets hot.
+  struct TieredFunction {
+    std::string name;
+    uint64_t module_id;
+    std::shared_ptr<const std::string> bitcode;
+  };
+
+  // Rename the functions defined in the module to their bodies, and instrument them in tiered
+  // mode. Return the pairs of function and body names.
+  std::vector<std::pair<std::string, std::string>> prepareModule(
+      llvm::Module* module, std::vector<uint64_t>* tiered_ids);
+  // Create stubs for the functions declared but not defined yet, so objects calling them can be
+  // linked. They are pointed to the functions when these are defined.
+  void createMissingStubs(const std::vector<std::string>& functions);
+  std::unique_ptr<CountingMemoryManager> createMemoryManager(bool is_object, bool is_main_only);
+  LinkedModule* findModule(uint64_t module_id);
+  void removeModule(uint64_t module_id);
+  std::string mangle(const std::string& name);
+  std::shared_ptr<llvm::RuntimeDyld::SymbolResolver> createResolver();
+  void defineFunction(const std::string& name, const Definition& definition,
+                      llvm::orc::TargetAddress address);
+
+  std::recursive_mutex mutex_;
+  LazyCompiler lazy_compiler_;
+  // Code run in the JIT is compiled for the host CPU.
+  std::unique_ptr<llvm::TargetMachine> target_machine_;
+  std::unique_ptr<llvm::TargetMachine> object_target_machine_;
+  // Used by addCompiledModule(), which runs on another thread than lazy compilation.
+  std::unique_ptr<llvm::TargetMachine> pipeline_target_machine_;
+  const llvm::DataLayout data_layout_;
+  ObjectLayer object_layer_;
+  CompileLayer compile_layer_;
+  std::unique_ptr<llvm::orc::JITCompileCallbackManager> compile_callback_manager_;
+  CompileOnDemandLayer compile_on_demand_layer_;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> stubs_manager_;
+  // Current definitions of toy functions, indexed by mangled function name.
+  std::map<std::string, Definition> definitions_;
+  uint64_t body_count_;
+  std::set<uint64_t> running_jobs_;
+  std::list<RetiredModule> retired_modules_;
+  bool compile_eagerly_;
+  // Modules in use, in the order they are added.
+  std::list<LinkedModule> linked_modules_;
+  uint64_t linked_module_count_;
+  JITMemoryUsage freed_usage_;
+  uint64_t freed_module_count_;
+  // Functions waiting to get hot, indexed by the id passed to requestTierUp().
+  std::map<uint64_t, TieredFunction> tiered_functions_;
+  uint64_t tiered_function_count_;
+  std::unique_ptr<llvm::TargetMachine> tier_up_target_machine_;
+};
+
+// The stubs manager used by CompileOnDemandLayer for the functions of a module. The layer points
+// each stub to a compile callback, which JIT code calls to compile the function on its first
+// call. The stub is pointed to a callback of LazyCompiler::locked_callbacks instead, which takes
+// the JIT lock, and runs the callback of the layer in the same scope. The callbacks of functions
+// not called yet can also be run before, see compilePendingFunctions().
+class LockedStubsManager : public llvm::orc::IndirectStubsManager {
+ public:
+  LockedStubsManager(std::unique_ptr<llvm::orc::IndirectStubsManager> base, LazyCompiler* compiler)
+      : base_(std::move(base)), compiler_(compiler) {
+    compiler_->stubs_managers.insert(this);
+  }
+
+  ~LockedStubsManager() override {
+    compiler_->stubs_managers.erase(this);
+  }
+
+  std::error_code createStub(const std::string& name, llvm::orc::TargetAddress address,
+                             llvm::JITSymbolFlags flags) override {
+    return base_->createStub(name, createLockedCallback(address), flags);
+  }
+
+  std::error_code createStubs(const StubInitsMap& stub_inits) override {
+    StubInitsMap locked_stub_inits;
+    for (auto& stub_init : stub_inits) {
+      locked_stub_inits[stub_init.getKey()] = std::make_pair(
+          createLockedCallback(stub_init.getValue().first), stub_init.getValue().second);
+    }
+    return base_->createStubs(locked_stub_inits);
+  }
+
+  llvm::orc::JITSymbol findStub(llvm::StringRef name, bool exported_stubs_only) override {
+    return base_->findStub(name, exported_stubs_only);
+  }
+
+  llvm::orc::JITSymbol findPointer(llvm::StringRef name) override {
+    return base_->findPointer(name);
+  }
+
+  std::error_code updatePointer(llvm::StringRef name, llvm::orc::TargetAddress address) override {
+    return base_->updatePointer(name, address);
+  }
+
+  // Compile the functions not called yet. The JIT lock is held.
+  void compilePendingFunctions() {
+    std::set<llvm::orc::TargetAddress> pending;
+    pending.swap(pending_callbacks_);
+    for (auto callback : pending) {
+      compiler_->locked_callbacks->executeCompileCallback(callback);
+    }
+  }
+
+ private:
+  // Return the address of a callback running the callback of the layer at layer_callback.
+  llvm::orc::TargetAddress createLockedCallback(llvm::orc::TargetAddress layer_callback) {
+    llvm::orc::JITCompileCallbackManager::CompileCallbackInfo info =
+        compiler_->locked_callbacks->getCompileCallback();
+    llvm::orc::TargetAddress callback = info.getAddress();
+    pending_callbacks_.insert(callback);
+    LazyCompiler* compiler = compiler_;
+    info.setCompileAction([this, compiler, callback, layer_callback]() {
+      std::lock_guard<std::recursive_mutex> lock(*compiler->mutex);
+      pending_callbacks_.erase(callback);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      llvm::orc::TargetAddress address =
+          compiler->layer_callbacks->executeCompileCallback(layer_callback);
+      compiler->compile_time += std::chrono::steady_clock::now() - start;
+      return address;
+    });
+    return callback;
+  }
+
+  std::unique_ptr<llvm::orc::IndirectStubsManager> base_;
+  LazyCompiler* compiler_;
+  // Callbacks of functions not compiled yet.
+  std::set<llvm::orc::TargetAddress> pending_callbacks_;
+};
+
+ToyJIT::ToyJIT()
+    : lazy_compiler_(&mutex_),
+      target_machine_(createHostTargetMachine(getCodeGenOptLevel())),
+      data_layout_(target_machine_->createDataLayout()),
+      compile_layer_(object_layer_, llvm::orc::SimpleCompiler(*target_machine_)),
+      compile_callback_manager_(
+          llvm::orc::createLocalCompileCallbackManager(target_machine_->getTargetTriple(), 0)),
+      compile_on_demand_layer_(
+          compile_layer_,
+          [](llvm::Function& function) { return std::set<llvm::Function*>({&function}); },
+          *compile_callback_manager_,
+          [this]() {
+            return std::unique_ptr<llvm::orc::IndirectStubsManager>(new LockedStubsManager(
+                llvm::orc::createLocalIndirectStubsManagerBuilder(
+                    target_machine_->getTargetTriple())(),
+                &lazy_compiler_));
+          }),
+      stubs_manager_(
+          llvm::orc::createLocalIndirectStubsManagerBuilder(target_machine_->getTargetTriple())()),
+      body_count_(0),
+      compile_eagerly_(false),
+      linked_module_count_(0),
+      freed_module_count_(0),
+      tiered_function_count_(0) {
+  if (global_option.tiered) {
+    tier_up_target_machine_.reset(createHostTargetMachine(llvm::CodeGenOpt::Aggressive));
+  }
+  if (global_option.pipeline) {
+    pipeline_target_machine_.reset(createHostTargetMachine(getCodeGenOptLevel()));
+  }
+  CHECK(compile_callback_manager_ != nullptr);
+  lazy_compiler_.layer_callbacks = compile_callback_manager_.get();
+  lazy_compiler_.locked_callbacks =
+      llvm::orc::createLocalCompileCallbackManager(target_machine_->getTargetTriple(), 0);
+  CHECK(lazy_compiler_.locked_callbacks != nullptr);
+  // Make symbols in the toy binary, like print and printd, visible to JIT code.
+  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+}
+
+// Modules are freed before their contexts.
+ToyJIT::~ToyJIT() {
+  for (auto& module : linked_modules_) {
+    if (!module.is_object && !module.is_compiled) {
+      compile_on_demand_layer_.removeModuleSet(module.handle);
+    }
+  }
+}
+
+std::vector<std::pair<std::string, std::string>> ToyJIT::prepareModule(
+    llvm::Module* module, std::vector<uint64_t>* tiered_ids) {
+  module->setDataLayout(data_layout_);
+  // Bitcode is extracted before functions are renamed or instrumented, so calls in it still go
+  // through stubs.
+  if (global_option.tiered) {
+    std::vector<llvm::Function*> tiered;
+    std::shared_ptr<const std::string> bitcode;
+    for (auto& function : *module) {
+      if (!function.isDeclaration() && !function.hasLocalLinkage() &&
+          !function.hasAvailableExternallyLinkage() &&
+          function.getName() != toy_main_function_name) {
+        if (bitcode == nullptr) {
+          bitcode = getModuleBitcode(module);
+        }
+        uint64_t id = ++tiered_function_count_;
+        tiered_functions_[id] = TieredFunction{function.getName(), 0, bitcode};
+        tiered.push_back(&function);
+        tiered_ids->push_back(id);
+      }
+    }
+    for (size_t i = 0; i < tiered.size(); ++i) {
+      instrumentFunction(tiered[i], (*tiered_ids)[i]);
+    }
+  }
+  // Calls in the module to its own functions still bind to the renamed bodies.
+  std::vector<std::pair<std::string, std::string>> functions;
+  for (auto& function : *module) {
+    if (function.isDeclaration() || function.hasLocalLinkage() ||
+        function.hasAvailableExternallyLinkage() || function.getName() == toy_main_function_name) {
+      continue;
+    }
+    std::string name = function.getName();
+    std::string body_name = stringPrintf("%s.%" PRIu64, name.c_str(), ++body_count_);
+    function.setName(body_name);
+    functions.push_back(std::make_pair(name, body_name));
+  }
+  return functions;
+}
+
+static bool hasGlobalVariables(llvm::Module* module) {
+  for (auto& variable : module->globals()) {
+    if (!variable.isDeclaration() && !variable.hasLocalLinkage()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t ToyJIT::addModule(std::unique_ptr<llvm::Module> module) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  std::vector<uint64_t> tiered_ids;
+  std::vector<std::pair<std::string, std::string>> functions =
+      prepareModule(module.get(), &tiered_ids);
+  bool has_global_variables = hasGlobalVariables(module.get());
+  llvm::LLVMContext* context = (global_option.pipeline ? &module->getContext() : nullptr);
+  std::vector<std::unique_ptr<llvm::Module>> modules;
+  modules.push_back(std::move(module));
+  // The handle is only known after adding the module, so the record is completed then.
+  std::unique_ptr<CountingMemoryManager> memory_manager =
+      createMemoryManager(false, functions.empty() && !has_global_variables);
+  LinkedModule& linked_module = linked_modules_.back();
+  linked_module.context.reset(context);
+  linked_module.handle = compile_on_demand_layer_.addModuleSet(
+      std::move(modules), std::move(memory_manager), createResolver());
+  for (auto id : tiered_ids) {
+    tiered_functions_[id].module_id = linked_module.id;
+  }
+  // Before the functions can be reached through their stubs.
+  if (compile_eagerly_) {
+    for (auto stubs_manager : lazy_compiler_.stubs_managers) {
+      stubs_manager->compilePendingFunctions();
+    }
+  }
+  Definition definition;
+  definition.module_id = linked_module.id;
+  definition.removable = (functions.size() == 1 && !has_global_variables);
+  for (auto& pair : functions) {
+    llvm::orc::TargetAddress address = getSymbolAddress(linked_module.id, pair.second);
+    CHECK(address != 0);
+    defineFunction(mangle(pair.first), definition, address);
+  }
+  return linked_module.id;
+}
+
+uint64_t ToyJIT::addCompiledModule(std::unique_ptr<llvm::Module> module) {
+  std::vector<uint64_t> tiered_ids;
+  std::vector<std::pair<std::string, std::string>> functions;
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    functions = prepareModule(module.get(), &tiered_ids);
+  }
+  bool has_global_variables = hasGlobalVariables(module.get());
+  std::vector<std::string> declared_functions;
+  for (auto& function : *module) {
+    if (function.isDeclaration() && !function.isIntrinsic()) {
+      declared_functions.push_back(function.getName());
+    }
+  }
+  llvm::object::OwningBinary<llvm::object::ObjectFile> object =
+      llvm::orc::SimpleCompiler(*pipeline_target_machine_)(*module);
+  CHECK(object.getBinary() != nullptr) << "failed to compile module";
+  // The object doesn't need the IR.
+  deleteModule(module.release());
+
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  createMissingStubs(declared_functions);
+  std::pair<std::unique_ptr<llvm::object::ObjectFile>, std::unique_ptr<llvm::MemoryBuffer>>
+      binary = object.takeBinary();
+  std::vector<std::unique_ptr<llvm::object::ObjectFile>> objects;
+  objects.push_back(std::move(binary.first));
+  std::unique_ptr<CountingMemoryManager> memory_manager =
+      createMemoryManager(false, functions.empty() && !has_global_variables);
+  LinkedModule& linked_module = linked_modules_.back();
+  linked_module.is_compiled = true;
+  linked_module.object_handle =
+      object_layer_.addObjectSet(std::move(objects), std::move(memory_manager), createResolver());
+  for (auto id : tiered_ids) {
+    tiered_functions_[id].module_id = linked_module.id;
+  }
+  Definition definition;
+  definition.module_id = linked_module.id;
+  definition.removable = (functions.size() == 1 && !has_global_variables);
+  for (auto& pair : functions) {
+    llvm::orc::TargetAddress address = getSymbolAddress(linked_module.id, pair.second);
+    CHECK(address != 0);
+    std::string mangled_name = mangle(pair.first);
+    if (definitions_.find(mangled_name) == definitions_.end()) {
+      defineFunction(mangled_name, definition, address);
+    } else {
+      linked_module.pending_definitions.push_back(
+          PendingDefinition{mangled_name, definition, address});
+    }
+  }
+  return linked_module.id;
+}
+
+void ToyJIT::defineFunctions(uint64_t module_id) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  LinkedModule* module = findModule(module_id);
+  CHECK(module != nullptr);
+  std::vector<PendingDefinition> pending_definitions;
+  pending_definitions.swap(module->pending_definitions);
+  for (auto& pending : pending_definitions) {
+    defineFunction(pending.name, pending.definition, pending.address);
+  }
+}
+
+void ToyJIT::createMissingStubs(const std::vector<std::string>& functions) {
+  for (auto& name : functions) {
+    std::string mangled_name = mangle(name);
+    if (definitions_.find(mangled_name) != definitions_.end() ||
+        llvm::RTDyldMemoryManager::getSymbolAddressInProcess(mangled_name) != 0) {
+      continue;
+    }
+    CHECK(!stubs_manager_->createStub(mangled_name, 0, llvm::JITSymbolFlags::Exported));
+    definitions_[mangled_name] = Definition{0, false};
+  }
 }
 
-static void prepareExecutionPipeline(llvm::Module* module) {
+std::string ToyJIT::compileObject(llvm::Module* module, std::vector<std::string>* functions) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  module->setDataLayout(data_layout_);
+  std::vector<llvm::Function*> bodies;
+  for (auto& function : *module) {
+    if (!function.isDeclaration() && !function.hasLocalLinkage() &&
+        !function.hasAvailableExternallyLinkage()) {
+      bodies.push_back(&function);
+    }
+  }
+  // Calls to the functions, even in the object, go to a declaration resolved to the stub.
+  for (auto body : bodies) {
+    std::string name = body->getName();
+    body->setName(name + snapshot_body_suffix);
+    llvm::Function* declaration = llvm::Function::Create(
+        body->getFunctionType(), llvm::GlobalValue::ExternalLinkage, name, module);
+    body->replaceAllUsesWith(declaration);
+    functions->push_back(name);
+  }
+  // Snapshots and preludes may be loaded on other machines, so they are compiled for a generic
+  // CPU.
+  if (object_target_machine_ == nullptr) {
+    object_target_machine_.reset(
+        llvm::EngineBuilder().setOptLevel(getCodeGenOptLevel()).selectTarget());
+  }
+  llvm::object::OwningBinary<llvm::object::ObjectFile> object =
+      llvm::orc::SimpleCompiler(*object_target_machine_)(*module);
+  CHECK(object.getBinary() != nullptr) << "failed to compile snapshot object";
+  return object.getBinary()->getData().str();
+}
+
+void ToyJIT::addObject(llvm::StringRef object, const std::vector<std::string>& functions) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  std::unique_ptr<llvm::MemoryBuffer> buffer =
+      llvm::MemoryBuffer::getMemBuffer(object, "snapshot object", false);
+  llvm::ErrorOr<std::unique_ptr<llvm::object::ObjectFile>> object_file =
+      llvm::object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+  CHECK(object_file) << "invalid snapshot object: " << object_file.getError().message();
+  // Functions in the object call each other through stubs, which must exist before the object
+  // is finalized.
+  for (auto& name : functions) {
+    std::string mangled_name = mangle(name);
+    if (definitions_.find(mangled_name) == definitions_.end()) {
+      CHECK(!stubs_manager_->createStub(mangled_name, 0, llvm::JITSymbolFlags::Exported));
+      definitions_[mangled_name] = Definition{0, false};
+    }
+  }
+  std::vector<std::unique_ptr<llvm::object::ObjectFile>> objects;
+  objects.push_back(std::move(*object_file));
+  std::unique_ptr<CountingMemoryManager> memory_manager = createMemoryManager(true, false);
+  uint64_t module_id = linked_modules_.back().id;
+  ObjectLayer::ObjSetHandleT handle =
+      object_layer_.addObjectSet(std::move(objects), std::move(memory_manager), createResolver());
+  for (auto& name : functions) {
+    llvm::orc::JITSymbol symbol =
+        object_layer_.findSymbolIn(handle, mangle(name + snapshot_body_suffix), true);
+    CHECK(symbol) << "snapshot object doesn't define " << name;
+    // The object is never removed.
+    defineFunction(mangle(name), Definition{module_id, false}, symbol.getAddress());
+  }
+}
+
+std::unique_ptr<CountingMemoryManager> ToyJIT::createMemoryManager(bool is_object,
+                                                                   bool is_main_only) {
+  std::shared_ptr<JITMemoryUsage> usage(new JITMemoryUsage);
+  linked_modules_.push_back(LinkedModule());
+  LinkedModule& module = linked_modules_.back();
+  module.id = ++linked_module_count_;
+  module.is_object = is_object;
+  module.is_main_only = is_main_only;
+  module.usage = usage;
+  return std::unique_ptr<CountingMemoryManager>(new CountingMemoryManager(usage));
+}
+
+ToyJIT::LinkedModule* ToyJIT::findModule(uint64_t module_id) {
+  // The module is usually one of the latest.
+  for (auto it = linked_modules_.rbegin(); it != linked_modules_.rend(); ++it) {
+    if (it->id == module_id) {
+      return &*it;
+    }
+  }
+  return nullptr;
+}
+
+void ToyJIT::removeModule(uint64_t module_id) {
+  for (auto it = tiered_functions_.begin(); it != tiered_functions_.end();) {
+    if (it->second.module_id == module_id) {
+      it = tiered_functions_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto it = linked_modules_.rbegin(); it != linked_modules_.rend(); ++it) {
+    if (it->id == module_id) {
+      CHECK(!it->is_object);
+      for (auto& object_handle : it->tier_up_objects) {
+        object_layer_.removeObjectSet(object_handle);
+      }
+      if (it->is_compiled) {
+        object_layer_.removeObjectSet(it->object_handle);
+      } else {
+        compile_on_demand_layer_.removeModuleSet(it->handle);
+      }
+      freed_usage_.add(*it->usage);
+      ++freed_module_count_;
+      // The context is deleted after the module.
+      linked_modules_.erase(std::next(it).base());
+      break;
+    }
+  }
+}
+
+void ToyJIT::setRunningJobs(const std::set<uint64_t>& jobs) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  running_jobs_ = jobs;
+  for (auto it = retired_modules_.begin(); it != retired_modules_.end();) {
+    std::set<uint64_t> still_running;
+    for (auto job : it->jobs) {
+      if (jobs.find(job) != jobs.end()) {
+        still_running.insert(job);
+      }
+    }
+    if (still_running.empty()) {
+      removeModule(it->module_id);
+      it = retired_modules_.erase(it);
+    } else {
+      it->jobs.swap(still_running);
+      ++it;
+    }
+  }
+}
+
+void ToyJIT::releaseMainModule(uint64_t module_id) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  LinkedModule* module = findModule(module_id);
+  if (module != nullptr && module->is_main_only) {
+    removeModule(module_id);
+  }
+}
+
+void ToyJIT::tierUp(uint64_t id, llvm::LLVMContext* context) {
+  std::string name;
+  std::shared_ptr<const std::string> bitcode;
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto it = tiered_functions_.find(id);
+    if (it == tiered_functions_.end()) {
+      return;
+    }
+    name = it->second.name;
+    bitcode = it->second.bitcode;
+  }
+  // Optimizing and compiling don't use the JIT, so JIT code can still compile functions lazily.
+  std::unique_ptr<llvm::MemoryBuffer> buffer =
+      llvm::MemoryBuffer::getMemBuffer(*bitcode, "tier up bitcode", false);
+  llvm::ErrorOr<std::unique_ptr<llvm::Module>> module =
+      llvm::parseBitcodeFile(buffer->getMemBufferRef(), *context);
+  CHECK(module) << "invalid tier up bitcode: " << module.getError().message();
+  keepOnlyFunction(module->get(), name);
+  (*module)->setDataLayout(data_layout_);
+  std::string body_name = stringPrintf("%s.hot%" PRIu64, name.c_str(), id);
+  (*module)->getFunction(name)->setName(body_name);
+  optTierUpModule(module->get(), tier_up_target_machine_.get());
+  llvm::object::OwningBinary<llvm::object::ObjectFile> object =
+      llvm::orc::SimpleCompiler(*tier_up_target_machine_)(**module);
+  CHECK(object.getBinary() != nullptr) << "failed to compile hot function " << name;
+
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto it = tiered_functions_.find(id);
+  std::string mangled_name = mangle(name);
+  auto definition = definitions_.find(mangled_name);
+  // The function may be redefined while it is compiled.
+  bool is_current = (it != tiered_functions_.end() && definition != definitions_.end() &&
+                     definition->second.module_id == it->second.module_id);
+  if (it != tiered_functions_.end()) {
+    tiered_functions_.erase(it);
+  }
+  if (!is_current) {
+    return;
+  }
+  LinkedModule* linked_module = findModule(definition->second.module_id);
+  CHECK(linked_module != nullptr);
+  std::pair<std::unique_ptr<llvm::object::ObjectFile>, std::unique_ptr<llvm::MemoryBuffer>>
+      binary = object.takeBinary();
+  std::vector<std::unique_ptr<llvm::object::ObjectFile>> objects;
+  objects.push_back(std::move(binary.first));
+  std::unique_ptr<CountingMemoryManager> memory_manager(
+      new CountingMemoryManager(linked_module->usage));
+  ObjectLayer::ObjSetHandleT handle =
+      object_layer_.addObjectSet(std::move(objects), std::move(memory_manager), createResolver());
+  linked_module->tier_up_objects.push_back(handle);
+  llvm::orc::JITSymbol symbol = object_layer_.findSymbolIn(handle, mangle(body_name), true);
+  CHECK(symbol) << "hot function object doesn't define " << name;
+  LOG(DEBUG) << "tier up function " << name;
+  CHECK(!stubs_manager_->updatePointer(mangled_name, symbol.getAddress()));
+}
+
+void ToyJIT::printMemoryUsage(FILE* fp) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  JITMemoryUsage live_usage;
+  for (auto& module : linked_modules_) {
+    live_usage.add(*module.usage);
+  }
+  fprintf(fp, "in use: %zu modules, code %" PRIu64 ", data %" PRIu64 ", metadata %" PRIu64
+              " bytes\n",
+          linked_modules_.size(), live_usage.code_bytes, live_usage.data_bytes,
+          live_usage.metadata_bytes);
+  fprintf(fp, "freed: %" PRIu64 " modules, code %" PRIu64 ", data %" PRIu64 ", metadata %" PRIu64
+              " bytes\n",
+          freed_module_count_, freed_usage_.code_bytes, freed_usage_.data_bytes,
+          freed_usage_.metadata_bytes);
+  for (auto& module : linked_modules_) {
+    fprintf(fp, "  %s %" PRIu64 ": code %" PRIu64 ", data %" PRIu64 ", metadata %" PRIu64 "\n",
+            (module.is_object ? "object" : "module"), module.id, module.usage->code_bytes,
+            module.usage->data_bytes, module.usage->metadata_bytes);
+  }
+  fflush(fp);
+}
+
+// Symbols are searched in function stubs first, then in JIT code, then in the toy binary.
+// The resolver is only called while the JIT lock is held. CompileOnDemandLayer copies it into
+// the callbacks of each partition, so it is shared.
+std::shared_ptr<llvm::RuntimeDyld::SymbolResolver> ToyJIT::createResolver() {
+  return llvm::orc::createLambdaResolver(
+      [this](const std::string& name) -> llvm::RuntimeDyld::SymbolInfo {
+        llvm::orc::JITSymbol stub = stubs_manager_->findStub(name, false);
+        if (stub) {
+          return llvm::RuntimeDyld::SymbolInfo(stub.getAddress(), stub.getFlags());
+        }
+        llvm::orc::JITSymbol symbol = compile_on_demand_layer_.findSymbol(name, false);
+        if (symbol) {
+          return llvm::RuntimeDyld::SymbolInfo(symbol.getAddress(), symbol.getFlags());
+        }
+        return llvm::RuntimeDyld::SymbolInfo(nullptr);
+      },
+      [](const std::string& name) -> llvm::RuntimeDyld::SymbolInfo {
+        uint64_t address = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name);
+        if (address != 0) {
+          return llvm::RuntimeDyld::SymbolInfo(address, llvm::JITSymbolFlags::Exported);
+        }
+        return llvm::RuntimeDyld::SymbolInfo(nullptr);
+      });
+}
+
+void ToyJIT::defineFunction(const std::string& name, const Definition& definition,
+                            llvm::orc::TargetAddress address) {
+  auto it = definitions_.find(name);
+  if (it == definitions_.end()) {
+    CHECK(!stubs_manager_->createStub(name, address, llvm::JITSymbolFlags::Exported));
+    definitions_[name] = definition;
+    return;
+  }
+  LOG(DEBUG) << "redefine function " << name;
+  CHECK(!stubs_manager_->updatePointer(name, address));
+  if (it->second.removable) {
+    if (running_jobs_.empty()) {
+      removeModule(it->second.module_id);
+    } else {
+      retired_modules_.push_back(RetiredModule{it->second.module_id, running_jobs_});
+    }
+  }
+  it->second = definition;
+}
+
+llvm::orc::TargetAddress ToyJIT::getSymbolAddress(uint64_t module_id, const std::string& name) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  LinkedModule* module = findModule(module_id);
+  CHECK(module != nullptr);
+  if (module->is_compiled) {
+    llvm::orc::JITSymbol symbol =
+        object_layer_.findSymbolIn(module->object_handle, mangle(name), true);
+    return (symbol ? symbol.getAddress() : 0);
+  }
+  llvm::orc::JITSymbol symbol =
+      compile_on_demand_layer_.findSymbolIn(module->handle, mangle(name), true);
+  return (symbol ? symbol.getAddress() : 0);
+}
+
+std::string ToyJIT::mangle(const std::string& name) {
+  std::string mangled_name;
+  llvm::raw_string_ostream os(mangled_name);
+  llvm::Mangler::getNameWithPrefix(os, name, data_layout_);
+  return os.str();
+}
+
+static std::unique_ptr<ToyJIT> jit;
+
+struct Job {
+  std::thread thread;
+  std::atomic<bool> done;
+  double value;
+  uint64_t module_id;
+};
+
+static std::map<uint64_t, std::unique_ptr<Job>> jobs;
+static uint64_t job_count;
+
+static ExecutionTime last_execution_time;
+
+// Hot functions are compiled one at a time, in a context of their own.
+static void runTierUpThread() {
+  llvm::LLVMContext context;
+  uint64_t id;
+  while (tier_up_queue->pop(&id)) {
+    jit->tierUp(id, &context);
+  }
+}
+
+static double toSeconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
+}
+
+static std::set<uint64_t> getRunningJobs() {
+  std::set<uint64_t> running_jobs;
+  for (auto& pair : jobs) {
+    if (!pair.second->done) {
+      running_jobs.insert(pair.first);
+    }
+  }
+  return running_jobs;
+}
+
+struct PreludeObject {
+  llvm::StringRef object;
+  std::vector<std::string> functions;
+};
+
+// Linked into each JIT when it is created.
+static std::vector<PreludeObject> prelude_objects;
+
+static void createJIT() {
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
-  std::string err;
-  llvm::ExecutionEngine* execution_engine =
-      llvm::EngineBuilder(std::unique_ptr<llvm::Module>(module))
-          .setErrorStr(&err)
-          .setEngineKind(llvm::EngineKind::JIT)
-          .create();
-  CHECK(execution_engine != nullptr) << err;
-  engine.reset(execution_engine);
+  jit.reset(new ToyJIT());
+  for (auto& prelude_object : prelude_objects) {
+    jit->addObject(prelude_object.object, prelude_object.functions);
+  }
+  if (global_option.tiered) {
+    tier_up_queue.reset(new BlockingQueue<uint64_t>);
+    tier_up_thread = std::thread(runTierUpThread);
+  }
 }
 
-void executionPipeline(llvm::Module* module) {
-  if (global_option.execute == false) {
-    return;
-  }
-  if (engine == nullptr) {
-    prepareExecutionPipeline(module);
-  } else {
-    engine->addModule(std::unique_ptr<llvm::Module>(module));
+void prepareExecutionPipeline() {
+  // Modules are compiled on the optimization thread in pipeline mode, so the JIT is created
+  // before the threads start.
+  if (global_option.pipeline && global_option.execute && jit == nullptr) {
+    createJIT();
   }
-  llvm::Function* main_function = module->getFunction(toy_main_function_name);
-  if (main_function != nullptr) {
-    LOG(DEBUG) << "Before finalizing Object";
-    engine->finalizeObject();
-    LOG(DEBUG) << "After finalizing Object";
-    void* jit_function = engine->getPointerToFunction(main_function);
-    CHECK(jit_function != nullptr);
+}
+
+// Run the main function of the module if it has one. Start is when adding the module began.
+static void runMainFunction(uint64_t module_id, std::chrono::steady_clock::time_point start) {
+  // Functions compiled eagerly while adding the module are already counted.
+  std::chrono::steady_clock::duration lazy_compile_start = jit->getLazyCompileTime();
+  std::chrono::steady_clock::time_point execute_start = std::chrono::steady_clock::now();
+  // __toy_main is defined in each module, so only look for it in the new module.
+  llvm::orc::TargetAddress address = jit->getSymbolAddress(module_id, toy_main_function_name);
+  if (address != 0) {
     LOG(DEBUG) << "Before executing JITFunction";
-    double value = reinterpret_cast<double (*)()>(jit_function)();
+    double value = reinterpret_cast<double (*)()>(static_cast<uintptr_t>(address))();
     LOG(DEBUG) << "After executing JITFunction";
     if (global_option.interactive) {
       printf("->%lf\n", value);
       fflush(stdout);
     }
+    jit->releaseMainModule(module_id);
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  // Functions compiled on their first call are counted as JIT time.
+  double lazy_compile_time = toSeconds(jit->getLazyCompileTime() - lazy_compile_start);
+  last_execution_time.jit_seconds = toSeconds(execute_start - start) + lazy_compile_time;
+  last_execution_time.execute_seconds = toSeconds(end - execute_start) - lazy_compile_time;
+}
+
+void executionPipeline(llvm::Module* module) {
+  if (global_option.execute == false) {
+    deleteModule(module);
+    return;
+  }
+  if (jit == nullptr) {
+    createJIT();
   }
+  std::set<uint64_t> running_jobs = getRunningJobs();
+  jit->setRunningJobs(running_jobs);
+  jit->setCompileEagerly(!running_jobs.empty());
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  uint64_t module_id = jit->addModule(std::unique_ptr<llvm::Module>(module));
+  runMainFunction(module_id, start);
+}
+
+uint64_t compileModulePipeline(llvm::Module* module) {
+  if (global_option.execute == false) {
+    deleteModule(module);
+    return 0;
+  }
+  return jit->addCompiledModule(std::unique_ptr<llvm::Module>(module));
+}
+
+void runModulePipeline(uint64_t module_id) {
+  if (module_id == 0) {
+    return;
+  }
+  jit->setRunningJobs(getRunningJobs());
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  jit->defineFunctions(module_id);
+  runMainFunction(module_id, start);
+}
+
+ExecutionTime getLastExecutionTime() {
+  return last_execution_time;
+}
+
+std::string compileSnapshotObject(std::unique_ptr<llvm::Module> module,
+                                  std::vector<std::string>* functions) {
+  if (jit == nullptr) {
+    createJIT();
+  }
+  std::string object = jit->compileObject(module.get(), functions);
+  deleteModule(module.release());
+  return object;
+}
+
+void addSnapshotObject(llvm::StringRef object, const std::vector<std::string>& functions) {
+  if (jit == nullptr) {
+    createJIT();
+  }
+  jit->addObject(object, functions);
+}
+
+void addPreludeObject(llvm::StringRef object, const std::vector<std::string>& functions) {
+  prelude_objects.push_back(PreludeObject{object, functions});
+}
+
+uint64_t startJobPipeline(llvm::Module* module) {
+  if (global_option.execute == false) {
+    deleteModule(module);
+    return 0;
+  }
+  if (jit == nullptr) {
+    createJIT();
+  }
+  jit->setRunningJobs(getRunningJobs());
+  // The job only runs compiled code, so it doesn't use LLVM state shared with code generation.
+  jit->setCompileEagerly(true);
+  uint64_t module_id = jit->addModule(std::unique_ptr<llvm::Module>(module));
+  llvm::orc::TargetAddress address = jit->getSymbolAddress(module_id, toy_main_function_name);
+  CHECK(address != 0);
+  uint64_t id = ++job_count;
+  Job* job = new Job;
+  job->done = false;
+  job->value = 0.0;
+  job->module_id = module_id;
+  jobs[id].reset(job);
+  job->thread = std::thread([job, address]() {
+    job->value = reinterpret_cast<double (*)()>(static_cast<uintptr_t>(address))();
+    job->done = true;
+  });
+  printf("job %" PRIu64 "\n", id);
+  fflush(stdout);
+  return id;
+}
+
+void waitJobPipeline(uint64_t id) {
+  auto it = jobs.find(id);
+  if (it == jobs.end()) {
+    LOG(ERROR) << "No job " << id;
+    return;
+  }
+  it->second->thread.join();
+  printf("->%lf\n", it->second->value);
+  fflush(stdout);
+  jit->releaseMainModule(it->second->module_id);
+  jobs.erase(it);
+  jit->setRunningJobs(getRunningJobs());
+}
+
+void listJobsPipeline() {
+  for (auto& pair : jobs) {
+    printf("job %" PRIu64 " %s\n", pair.first, (pair.second->done ? "done" : "running"));
+  }
+  fflush(stdout);
+}
+
+void printJITMemoryPipeline() {
+  if (jit == nullptr) {
+    printf("no JIT module\n");
+    fflush(stdout);
+    return;
+  }
+  jit->printMemoryUsage(stdout);
 }
 
 void finishExecutionPipeline() {
-  engine.reset(nullptr);
+  for (auto& pair : jobs) {
+    pair.second->thread.join();
+  }
+  if (jit != nullptr) {
+    jit->setRunningJobs(std::set<uint64_t>());
+  }
+  if (tier_up_thread.joinable()) {
+    jit->cancelTierUps();
+    tier_up_queue->close();
+    tier_up_thread.join();
+    tier_up_queue.reset(nullptr);
+  }
+  if (global_option.dump_mem && jit != nullptr) {
+    jit->printMemoryUsage(stderr);
+  }
+  jobs.clear();
+  job_count = 0;
+  jit.reset(nullptr);
 }
 
 void executionMain(llvm::Module* module) {
@@ -2,6 +2,9 @@
 #define TOY_EXECUTION_H_
 
 #include <memory>
+#include <string>
+#include <vector>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/Module.h>
 
 // Used in interactive mode.
@@ -9,6 +12,40 @@ void prepareExecutionPipeline();
 void executionPipeline(llvm::Module* module);
 void finishExecutionPipeline();
 
+// Used in pipeline mode, where a module is compiled on the optimization thread while the
+// previous one runs. Add the module to the JIT compiled, and return its id, or 0 if it isn't
+// executed. Functions it redefines still call the old bodies until runModulePipeline().
+uint64_t compileModulePipeline(llvm::Module* module);
+// Define the functions of the module and run its main function, on the execution thread.
+void runModulePipeline(uint64_t module_id);
+
+// Time spent in the last executionPipeline() or runModulePipeline() call, in seconds.
+struct ExecutionTime {
+  // Adding the module to the JIT, and compiling functions.
+  double jit_seconds;
+  // Running the code.
+  double execute_seconds;
+};
+
+ExecutionTime getLastExecutionTime();
+
+// Used by REPL snapshots. Compile the module into an object, and return the names of the
+// functions it defines.
+std::string compileSnapshotObject(std::unique_ptr<llvm::Module> module,
+                                  std::vector<std::string>* functions);
+// Link an object from compileSnapshotObject() without compiling anything.
+void addSnapshotObject(llvm::StringRef object, const std::vector<std::string>& functions);
+// Link the object of a prelude into each JIT created later. The object must outlive them.
+void addPreludeObject(llvm::StringRef object, const std::vector<std::string>& functions);
+
+// Run the module in a background job, and return the job id.
+uint64_t startJobPipeline(llvm::Module* module);
+// Wait until the job finishes and print its value.
+void waitJobPipeline(uint64_t id);
+void listJobsPipeline();
+// Print the memory the JIT allocated for modules in use and freed.
+void printJITMemoryPipeline();
+
 // Used in non-interactive mode.
 void executionMain(llvm::Module* module);
 
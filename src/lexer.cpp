@@ -1,10 +1,14 @@
 #include "lexer.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <deque>
+#include <iostream>
 #include <map>
 #include <stack>
 #include <string>
@@ -38,8 +42,9 @@ static const std::map<TokenType, std::string> token_name_map = {
 };
 
 static const std::unordered_map<char, std::vector<std::string>> op_init_map = {
-    {'+', {"+"}},       {'-', {"-"}},  {'*', {"*"}},       {'/', {"/"}},
-    {'<', {"<=", "<"}}, {'=', {"=="}}, {'>', {">=", ">"}}, {'!', {"!="}},
+    {'+', {"+"}},  {'-', {"-"}},  {'*', {"*"}},  {'/', {"/"}},
+    {'%', {"%"}},  {'&', {"&"}},  {'|', {"|"}},  {'^', {"^"}},
+    {'=', {"=="}}, {'!', {"!="}}, {'<', {"<<", "<=", "<"}}, {'>', {">>", ">=", ">"}},
 };
 
 static std::unordered_map<char, std::vector<std::string>> op_map;
@@ -51,6 +56,10 @@ static const std::unordered_map<std::string, TokenType> keyword_map = {
 };
 
 void printPrompt() {
+  // Results are printed by another thread in pipeline mode, so prompts would be interleaved.
+  if (global_option.pipeline) {
+    return;
+  }
   printf(">");
   fflush(stdout);
 }
@@ -136,13 +145,37 @@ static std::deque<CharWithLoc> char_deque;
 static size_t curr_line = 1;
 static size_t curr_column = 1;
 
+// Stdin is read into this buffer instead of through std::cin, whose stdio buffer can't be
+// inspected, so hasPendingInput() sees all the input read but not lexed yet.
+static char stdin_buffer[4096];
+static size_t stdin_buffer_pos = 0;
+static size_t stdin_buffer_size = 0;
+
+static int readChar() {
+  if (global_option.in_stream != &std::cin) {
+    return global_option.in_stream->get();
+  }
+  if (stdin_buffer_pos == stdin_buffer_size) {
+    ssize_t size;
+    do {
+      size = read(STDIN_FILENO, stdin_buffer, sizeof(stdin_buffer));
+    } while (size < 0 && errno == EINTR);
+    if (size <= 0) {
+      return EOF;
+    }
+    stdin_buffer_pos = 0;
+    stdin_buffer_size = size;
+  }
+  return static_cast<unsigned char>(stdin_buffer[stdin_buffer_pos++]);
+}
+
 static CharWithLoc getChar() {
   if (!char_deque.empty()) {
     CharWithLoc ret = char_deque.front();
     char_deque.pop_front();
     return ret;
   }
-  int ch = global_option.in_stream->get();
+  int ch = readChar();
   CharWithLoc ret;
   ret.ch = ch;
   ret.loc.line = curr_line;
@@ -400,12 +433,36 @@ void unreadCurrToken() {
   token_buffer.moveTowardStart();
 }
 
+bool hasPendingInput() {
+  if (!token_buffer.isEnd()) {
+    return true;
+  }
+  for (auto& ch : char_deque) {
+    if (!isspace(ch.ch)) {
+      return true;
+    }
+  }
+  if (global_option.in_stream != &std::cin) {
+    return global_option.in_stream->rdbuf()->in_avail() > 0;
+  }
+  for (size_t i = stdin_buffer_pos; i < stdin_buffer_size; ++i) {
+    if (!isspace(static_cast<unsigned char>(stdin_buffer[i]))) {
+      return true;
+    }
+  }
+  struct pollfd fd;
+  fd.fd = STDIN_FILENO;
+  fd.events = POLLIN;
+  fd.revents = 0;
+  return poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN) != 0;
+}
+
 void addDynamicOp(char op) {
   std::string s(1, op);
   auto it = op_map.find(op);
   if (it != op_map.end()) {
+    // Builtin operators like | are already lexed as operators when they are redefined.
     if (it->second.back() == s) {
-      LOG(ERROR) << "Add existing op: " << s;
       return;
     }
     it->second.push_back(s);
@@ -419,6 +476,8 @@ void resetLexer() {
   tokens_in_curline = 0;
   op_map = op_init_map;
   char_deque.clear();
+  stdin_buffer_pos = 0;
+  stdin_buffer_size = 0;
   curr_line = 1;
   curr_column = 1;
   token_buffer.clear();
@@ -65,6 +65,9 @@ const Token& currToken();
 const Token& getNextToken();
 void unreadCurrToken();
 
+// Return true if more input can be read without waiting for the user.
+bool hasPendingInput();
+
 extern size_t exprs_in_curline;
 void printPrompt();
 
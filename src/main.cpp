@@ -1,6 +1,7 @@
 #include "option.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <fstream>
@@ -12,8 +13,13 @@
 #include "logging.h"
 #include "optimization.h"
 #include "parse.h"
+#include "profile.h"
+#include "repl.h"
+#include "simplify.h"
+#include "snapshot.h"
 #include "strings.h"
 #include "supportlib.h"
+#include "type_inference.h"
 
 static void usage(const std::string& exec_name) {
   printf("%s  Experiment a toy language\n", exec_name.c_str());
@@ -21,13 +27,19 @@ static void usage(const std::string& exec_name) {
       "Usage:\n"
       "-c <file>       Compile the code into object file.\n"
       "-s <file>       Compile the code into assembly file.\n"
+      "--auto-parallel Run for loops on all cores when their iterations are\n"
+      "                independent, like sums of pure functions.\n"
       "--debug-pass    Print llvm compilation passes.\n"
       "--dump dumpType1, dumpType2,...\n"
       "                Dump specified contents. Possible type list:\n"
       "                  token:  Dump all tokens received.\n"
       "                  ast:    Dump abstract syntax tree.\n"
       "                  code:   Dump generated IR code.\n"
+      "                  mem:    Dump JIT memory of modules at exit.\n"
       "                  none:   Don't dump any thing.\n"
+      "--emit-prelude <lib>\n"
+      "                Precompile functions of the input file into <lib>.o,\n"
+      "                with their declarations in <lib>.decls.\n"
       "-g              Add debug info.\n"
       "-h/--help       Print this help information.\n"
       "-i <file>       Read input from specified file instead of standard\n"
@@ -38,7 +50,34 @@ static void usage(const std::string& exec_name) {
       "                Set log level, can be debug/info/error/fatal.\n"
       "                Default is debug.\n"
       "--no-execute    Don't execute code.\n"
-      "Default Option: --dump code\n\n");
+      "-O<level>       Optimize at level 0, 1, 2, 3, or s for size, in both\n"
+      "                the JIT and compiled files. Default is 2.\n"
+      "--prelude <lib> Make functions precompiled by --emit-prelude available\n"
+      "                without parsing or compiling them.\n"
+      "--profile-generate <file>\n"
+      "                Count calls and branches, and write the counts to\n"
+      "                <file> when the program returns.\n"
+      "--profile-use <file>\n"
+      "                Optimize for the counts written by --profile-generate.\n"
+      "--pipeline      In interactive mode, optimize and execute statements\n"
+      "                on separate threads while parsing the following ones.\n"
+      "--restore <file>\n"
+      "                Start the interactive session from a snapshot saved\n"
+      "                by :save.\n"
+      "--tiered        Compile functions at -O0 first, and recompile hot\n"
+      "                functions at -O3 in the background.\n"
+      "--tier-up-threshold <n>\n"
+      "                Recompile a function after n calls and loop\n"
+      "                iterations in tiered mode. Default is 10000.\n"
+      "Default Option: --dump code\n\n"
+      "Commands in interactive mode:\n"
+      ":job Statement  Run the statement in a background job, and print\n"
+      "                the job id.\n"
+      ":wait JobId     Wait for the job and print its value.\n"
+      ":jobs           List jobs not waited yet.\n"
+      ":mem            Print memory allocated by the JIT for modules.\n"
+      ":save \"file\"    Save definitions and global variables of the session\n"
+      "                as a snapshot.\n\n");
 }
 
 bool nextArgumentOrError(const std::vector<std::string>& Args, size_t& i) {
@@ -67,6 +106,8 @@ static bool parseOptions(int argc, char** argv) {
       }
       global_option.compile = true;
       global_option.compile_output_file = args[i];
+    } else if (args[i] == "--auto-parallel") {
+      global_option.auto_parallel = true;
     } else if (args[i] == "--debug-pass") {
       global_option.debug_pass = true;
     } else if (args[i] == "--dump") {
@@ -76,6 +117,7 @@ static bool parseOptions(int argc, char** argv) {
       global_option.dump_token = false;
       global_option.dump_ast = false;
       global_option.dump_code = false;
+      global_option.dump_mem = false;
       std::vector<std::string> dump_list = stringSplit(args[i], ',');
       for (const auto& item : dump_list) {
         if (item == "token") {
@@ -84,12 +126,19 @@ static bool parseOptions(int argc, char** argv) {
           global_option.dump_ast = true;
         } else if (item == "code") {
           global_option.dump_code = true;
+        } else if (item == "mem") {
+          global_option.dump_mem = true;
         } else if (item == "none") {
         } else {
           LOG(ERROR) << "Unknown dump type " << item;
           return false;
         }
       }
+    } else if (args[i] == "--emit-prelude") {
+      if (!nextArgumentOrError(args, i)) {
+        return false;
+      }
+      global_option.emit_prelude_file = args[i];
     } else if (args[i] == "-g") {
       global_option.debug = true;
     } else if (args[i] == "-h" || args[i] == "--help") {
@@ -122,6 +171,34 @@ static bool parseOptions(int argc, char** argv) {
       }
     } else if (args[i] == "--no-execute") {
       global_option.execute = false;
+    } else if (args[i] == "-O0" || args[i] == "-O1" || args[i] == "-O2" || args[i] == "-O3") {
+      global_option.opt_level = args[i][2] - '0';
+      global_option.size_level = 0;
+    } else if (args[i] == "-Os") {
+      global_option.opt_level = 2;
+      global_option.size_level = 1;
+    } else if (args[i] == "--prelude") {
+      if (!nextArgumentOrError(args, i)) {
+        return false;
+      }
+      global_option.prelude_file = args[i];
+    } else if (args[i] == "--profile-generate") {
+      if (!nextArgumentOrError(args, i)) {
+        return false;
+      }
+      global_option.profile_generate_file = args[i];
+    } else if (args[i] == "--profile-use") {
+      if (!nextArgumentOrError(args, i)) {
+        return false;
+      }
+      global_option.profile_use_file = args[i];
+    } else if (args[i] == "--pipeline") {
+      global_option.pipeline = true;
+    } else if (args[i] == "--restore") {
+      if (!nextArgumentOrError(args, i)) {
+        return false;
+      }
+      global_option.restore_file = args[i];
     } else if (args[i] == "-o") {
       if (!nextArgumentOrError(args, i)) {
         return false;
@@ -139,6 +216,17 @@ static bool parseOptions(int argc, char** argv) {
       }
       global_option.compile_assembly = true;
       global_option.compile_assembly_output_file = args[i];
+    } else if (args[i] == "--tiered") {
+      global_option.tiered = true;
+    } else if (args[i] == "--tier-up-threshold") {
+      if (!nextArgumentOrError(args, i)) {
+        return false;
+      }
+      global_option.tier_up_threshold = strtoull(args[i].c_str(), nullptr, 10);
+      if (global_option.tier_up_threshold == 0) {
+        LOG(ERROR) << "Invalid tier up threshold: " << args[i];
+        return false;
+      }
     } else {
       LOG(ERROR) << "Unknown Option: " << args[i];
       return false;
@@ -148,43 +236,60 @@ static bool parseOptions(int argc, char** argv) {
     LOG(ERROR) << "Toy can't compile while being interactive\n";
     return false;
   }
+  if (global_option.pipeline && !global_option.interactive) {
+    LOG(ERROR) << "Toy can only pipeline statements while being interactive\n";
+    return false;
+  }
+  // In non-interactive mode, global variables are private to the module, so a function can't be
+  // recompiled in a module of its own.
+  if (global_option.tiered && !global_option.interactive) {
+    LOG(ERROR) << "Toy can only tier functions while being interactive\n";
+    return false;
+  }
+  if (!global_option.restore_file.empty() && !global_option.interactive) {
+    LOG(ERROR) << "Toy can only restore a snapshot while being interactive\n";
+    return false;
+  }
+  if (!global_option.emit_prelude_file.empty() && global_option.interactive) {
+    LOG(ERROR) << "Toy can't emit a prelude while being interactive\n";
+    return false;
+  }
+  // Functions are profiled by name, which is only unique in non-interactive mode.
+  if ((!global_option.profile_generate_file.empty() || !global_option.profile_use_file.empty()) &&
+      (global_option.interactive || !global_option.emit_prelude_file.empty())) {
+    LOG(ERROR) << "Toy can only profile a program while being non-interactive\n";
+    return false;
+  }
+  // Loops can only be proven independent when all functions of the program are known.
+  if (global_option.auto_parallel &&
+      (global_option.interactive || !global_option.emit_prelude_file.empty())) {
+    LOG(ERROR) << "Toy can only parallelize loops while being non-interactive\n";
+    return false;
+  }
+  // Parallel loops don't have the counters of the sequential loops.
+  if (global_option.auto_parallel &&
+      (!global_option.profile_generate_file.empty() || !global_option.profile_use_file.empty())) {
+    LOG(ERROR) << "Toy can't profile a program with parallel loops\n";
+    return false;
+  }
+  // Functions of the prelude are only linked in the JIT.
+  if (!global_option.prelude_file.empty() &&
+      (global_option.compile || global_option.compile_assembly)) {
+    LOG(ERROR) << "Toy can't compile with a prelude\n";
+    return false;
+  }
 
   LOG(DEBUG) << global_option.str();
   return true;
 }
 
-static void interactiveMain() {
-  prepareParsePipeline();
-  prepareCodePipeline();
-  prepareOptPipeline();
-  prepareExecutionPipeline();
-
-  printPrompt();
-  while (true) {
-    ExprAST* expr = parsePipeline();
-    if (expr != nullptr) {
-      std::unique_ptr<llvm::Module> module = codePipeline(expr);
-      if (module != nullptr) {
-        optPipeline(module.get());
-        executionPipeline(module.release());
-      }
-    } else {
-      Token curr = currToken();
-      if (curr.type == TOKEN_EOF) {
-        break;
-      }
-    }
-  }
-
-  finishExecutionPipeline();
-  finishCodePipeline();
-  finishOptPipeline();
-  finishParsePipeline();
-}
-
 static void nonInteractiveMain() {
   LOG(DEBUG) << "parseMain()";
   std::vector<ExprAST*> exprs = parseMain();
+  LOG(DEBUG) << "simplifyMain()";
+  exprs = simplifyMain(exprs);
+  LOG(DEBUG) << "typeInferenceMain()";
+  typeInferenceMain(exprs);
   LOG(DEBUG) << "codeMain()";
   std::unique_ptr<llvm::Module> module = codeMain(exprs);
   LOG(DEBUG) << "optMain()";
@@ -201,12 +306,43 @@ static void nonInteractiveMain() {
   executionMain(module.release());
 }
 
+static bool emitPreludeMain() {
+  std::vector<ExprAST*> exprs = parseMain();
+  exprs = simplifyMain(exprs);
+  typeInferenceMain(exprs);
+  std::vector<PrototypeAST*> prototypes;
+  for (auto expr : exprs) {
+    if (expr->type() == FUNCTION_AST) {
+      prototypes.push_back(reinterpret_cast<FunctionAST*>(expr)->getPrototype());
+    } else if (expr->type() == PROTOTYPE_AST) {
+      prototypes.push_back(reinterpret_cast<PrototypeAST*>(expr));
+    } else {
+      LOG(ERROR) << "A prelude can only define and declare functions, loc "
+                 << expr->getLoc().toString();
+      return false;
+    }
+  }
+  std::unique_ptr<llvm::Module> module = codePreludeMain(exprs);
+  optMain(module.get());
+  return savePrelude(getUserDefinedOps(), prototypes, std::move(module),
+                     global_option.emit_prelude_file);
+}
+
 int main(int argc, char** argv) {
   if (!parseOptions(argc, argv)) {
     return -1;
   }
 
   initSupportLib();
+  if (!global_option.prelude_file.empty() && !loadPrelude(global_option.prelude_file)) {
+    return -1;
+  }
+  if (!global_option.emit_prelude_file.empty()) {
+    return emitPreludeMain() ? 0 : -1;
+  }
+  if (!global_option.profile_use_file.empty() && !loadProfile(global_option.profile_use_file)) {
+    return -1;
+  }
   if (global_option.interactive) {
     interactiveMain();
   } else {
@@ -1,70 +1,585 @@
 #include "optimization.h"
 
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <vector>
 
 #include <llvm/Pass.h>
 #include <llvm/PassSupport.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/DebugInfo.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/ValueHandle.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 
-class HelloModulePass : public llvm::ModulePass {
+#include "code.h"
+#include "logging.h"
+#include "option.h"
+
+// Comparisons are i1 values, but they become double when passed through a double, like the
+// result of a function, and are compared with 0.0 again when used as conditions of if and for.
+// Replace fcmp one (uitofp i1 c), 0.0 with c, and fcmp oeq (uitofp i1 c), 0.0 with !c. Ints
+// converted to double are compared with 0 as ints, because the conversion is never NaN and is
+// only 0.0 for 0.
+class ToyConditionPass : public llvm::FunctionPass {
  public:
   static char ID;
-  HelloModulePass() : llvm::ModulePass(ID) {
+  ToyConditionPass() : llvm::FunctionPass(ID) {
   }
 
-  bool runOnModule(llvm::Module& m) {
-    // printf("HelloModulePass: module %s\n", m.getName().data());
-    return false;
+  bool runOnFunction(llvm::Function& function) override {
+    // Deleting dead instructions may delete compares collected later.
+    std::vector<llvm::WeakVH> compares;
+    for (auto& basic_block : function) {
+      for (auto& instruction : basic_block) {
+        if (llvm::isa<llvm::FCmpInst>(&instruction)) {
+          compares.push_back(&instruction);
+        }
+      }
+    }
+    bool changed = false;
+    for (auto& handle : compares) {
+      llvm::FCmpInst* compare = llvm::cast_or_null<llvm::FCmpInst>(handle);
+      if (compare == nullptr) {
+        continue;
+      }
+      llvm::Value* condition = getIntCondition(compare);
+      if (condition != nullptr) {
+        compare->replaceAllUsesWith(condition);
+        llvm::RecursivelyDeleteTriviallyDeadInstructions(compare);
+        changed = true;
+      }
+    }
+    return changed;
   }
-};
 
-char HelloModulePass::ID;
+ private:
+  static llvm::Value* getIntCondition(llvm::FCmpInst* compare) {
+    llvm::CmpInst::Predicate predicate = compare->getPredicate();
+    bool is_not_equal =
+        (predicate == llvm::CmpInst::FCMP_ONE || predicate == llvm::CmpInst::FCMP_UNE);
+    bool is_equal = (predicate == llvm::CmpInst::FCMP_OEQ || predicate == llvm::CmpInst::FCMP_UEQ);
+    llvm::ConstantFP* zero = llvm::dyn_cast<llvm::ConstantFP>(compare->getOperand(1));
+    llvm::CastInst* cast = llvm::dyn_cast<llvm::CastInst>(compare->getOperand(0));
+    if ((!is_not_equal && !is_equal) || zero == nullptr || !zero->isZero() || cast == nullptr ||
+        (cast->getOpcode() != llvm::Instruction::UIToFP &&
+         cast->getOpcode() != llvm::Instruction::SIToFP)) {
+      return nullptr;
+    }
+    llvm::Value* value = cast->getOperand(0);
+    llvm::IRBuilder<> builder(compare);
+    if (value->getType()->isIntegerTy(1) && cast->getOpcode() == llvm::Instruction::UIToFP) {
+      return (is_not_equal ? value : builder.CreateNot(value, compare->getName()));
+    }
+    llvm::Value* int_zero = llvm::ConstantInt::get(value->getType(), 0);
+    return (is_not_equal ? builder.CreateICmpNE(value, int_zero, compare->getName())
+                         : builder.CreateICmpEQ(value, int_zero, compare->getName()));
+  }
+};
 
-static llvm::RegisterPass<HelloModulePass> HelloModulePassRegister("helloModulePass",
-                                                                   "Hello Module Pass");
+char ToyConditionPass::ID = 0;
+static llvm::RegisterPass<ToyConditionPass> ToyConditionPassRegister(
+    "toyCondition", "Compare toy conditions without converting them to double");
 
-class HelloFunctionPass : public llvm::FunctionPass {
+// Codegen leaves blocks that only branch, like the if_else block of an if without else, blocks
+// that can be merged into their only predecessor, like for_after_loop, and stores to local
+// variables that are never read. They are removed at all -O levels, but variables described in
+// debug info are kept for the debugger.
+class ToyCleanupPass : public llvm::FunctionPass {
  public:
   static char ID;
-  HelloFunctionPass() : llvm::FunctionPass(ID) {
+  ToyCleanupPass() : llvm::FunctionPass(ID) {
   }
 
-  bool runOnFunction(llvm::Function& F) override {
-    // printf("HelloFunctionPass: %s\n", F.getName().data());
-    return false;
+  bool runOnFunction(llvm::Function& function) override {
+    bool changed = removeUnreadLocals(function);
+    changed |= llvm::removeUnreachableBlocks(function);
+    for (auto it = function.begin(); it != function.end();) {
+      llvm::BasicBlock* basic_block = &*it++;
+      if (basic_block == &function.getEntryBlock()) {
+        continue;
+      }
+      if (llvm::MergeBlockIntoPredecessor(basic_block)) {
+        changed = true;
+        continue;
+      }
+      llvm::BranchInst* branch = llvm::dyn_cast<llvm::BranchInst>(basic_block->getTerminator());
+      if (branch != nullptr && branch->isUnconditional() &&
+          branch->getSuccessor(0) != basic_block &&
+          basic_block->getFirstNonPHIOrDbg() == branch) {
+        changed |= llvm::TryToSimplifyUncondBranchFromEmptyBlock(basic_block);
+      }
+    }
+    return changed;
+  }
+
+ private:
+  static bool removeUnreadLocals(llvm::Function& function) {
+    // Deleting stored values may delete locals they are loaded from.
+    std::vector<llvm::WeakVH> locals;
+    for (auto& instruction : function.getEntryBlock()) {
+      if (llvm::isa<llvm::AllocaInst>(&instruction)) {
+        locals.push_back(&instruction);
+      }
+    }
+    bool changed = false;
+    for (auto& handle : locals) {
+      llvm::AllocaInst* local = llvm::cast_or_null<llvm::AllocaInst>(handle);
+      if (local == nullptr || llvm::FindAllocaDbgDeclare(local) != nullptr) {
+        continue;
+      }
+      bool is_read = false;
+      for (auto user : local->users()) {
+        llvm::StoreInst* store = llvm::dyn_cast<llvm::StoreInst>(user);
+        if (store == nullptr || store->getPointerOperand() != local) {
+          is_read = true;
+        }
+      }
+      if (is_read) {
+        continue;
+      }
+      while (!local->use_empty()) {
+        llvm::StoreInst* store = llvm::cast<llvm::StoreInst>(local->user_back());
+        llvm::Value* value = store->getValueOperand();
+        store->eraseFromParent();
+        llvm::RecursivelyDeleteTriviallyDeadInstructions(value);
+      }
+      local->eraseFromParent();
+      changed = true;
+    }
+    return changed;
   }
 };
 
-char HelloFunctionPass::ID = 0;
-static llvm::RegisterPass<HelloFunctionPass> HelloFunctionPassRegister("helloFunctionPass",
-                                                                       "Hello Function Pass");
+char ToyCleanupPass::ID = 0;
+static llvm::RegisterPass<ToyCleanupPass> ToyCleanupPassRegister(
+    "toyCleanup", "Remove empty blocks and unread local variables left by toy codegen");
+
+static void addToyConditionPass(const llvm::PassManagerBuilder& builder,
+                                llvm::legacy::PassManagerBase& pm) {
+  pm.add(new ToyConditionPass);
+}
+
+// In interactive mode, optimized copies of small functions defined in previous modules are kept
+// in inline_library. They are imported into later modules using them as available_externally
+// definitions, so they can be inlined across modules.
+static std::unique_ptr<llvm::Module> inline_library;
+
+// Inlined bodies don't follow redefinitions. So unoptimized copies of the functions of modules
+// importing from inline_library are kept in importer_library, and importers holds the names of
+// the functions which may have inlined each function. When a function is redefined, the
+// functions which may have inlined it are recompiled from their copies in the same module.
+static std::unique_ptr<llvm::Module> importer_library;
+static std::map<std::string, std::set<std::string>> importers;
+
+// Functions with more instructions aren't kept for inlining.
+static const size_t max_inline_function_size = 64;
+
+static void collectGlobalValues(llvm::Constant* constant, std::set<llvm::GlobalValue*>* values) {
+  if (llvm::GlobalValue* value = llvm::dyn_cast<llvm::GlobalValue>(constant)) {
+    values->insert(value);
+    return;
+  }
+  for (auto& operand : constant->operands()) {
+    if (llvm::Constant* child = llvm::dyn_cast<llvm::Constant>(operand)) {
+      collectGlobalValues(child, values);
+    }
+  }
+}
+
+// Clone the body of src into dst, which is in another module. Global values used by src are
+// declared in the module of dst if not there yet, and new function declarations are added to
+// new_declarations. Return false without changing dst if src uses global values only visible in
+// its own module.
+static bool cloneFunctionBody(llvm::Function* src, llvm::Function* dst,
+                              std::vector<llvm::Function*>* new_declarations) {
+  std::set<llvm::GlobalValue*> values;
+  for (auto& basic_block : *src) {
+    for (auto& instruction : basic_block) {
+      for (auto& operand : instruction.operands()) {
+        if (llvm::Constant* constant = llvm::dyn_cast<llvm::Constant>(operand)) {
+          collectGlobalValues(constant, &values);
+        }
+      }
+    }
+  }
+  for (auto value : values) {
+    if (value->hasLocalLinkage()) {
+      return false;
+    }
+  }
+  llvm::Module* module = dst->getParent();
+  llvm::ValueToValueMapTy vmap;
+  for (auto value : values) {
+    llvm::GlobalValue* target = module->getNamedValue(value->getName());
+    if (target != nullptr && target->getType() != value->getType()) {
+      return false;
+    }
+    if (target != nullptr) {
+      vmap[value] = target;
+    } else if (llvm::Function* function = llvm::dyn_cast<llvm::Function>(value)) {
+      llvm::Function* declaration =
+          llvm::Function::Create(function->getFunctionType(), llvm::GlobalValue::ExternalLinkage,
+                                 function->getName(), module);
+      declaration->copyAttributesFrom(function);
+      vmap[value] = declaration;
+      if (new_declarations != nullptr) {
+        new_declarations->push_back(declaration);
+      }
+    } else {
+      llvm::GlobalVariable* variable = llvm::cast<llvm::GlobalVariable>(value);
+      llvm::GlobalVariable* declaration = new llvm::GlobalVariable(
+          *module, variable->getValueType(), variable->isConstant(),
+          llvm::GlobalValue::ExternalLinkage, nullptr, variable->getName());
+      declaration->setAlignment(variable->getAlignment());
+      vmap[value] = declaration;
+    }
+  }
+  auto dst_arg = dst->arg_begin();
+  for (auto& arg : src->args()) {
+    vmap[&arg] = &*dst_arg++;
+  }
+  llvm::SmallVector<llvm::ReturnInst*, 8> returns;
+  llvm::CloneFunctionInto(dst, src, vmap, true, returns);
+  return true;
+}
+
+static size_t getInstructionCount(const llvm::Function& function) {
+  size_t count = 0;
+  for (auto& basic_block : function) {
+    count += basic_block.size();
+  }
+  return count;
+}
+
+// Import definitions of functions declared in the module, and add their names to imported.
+static void importFunctions(llvm::Module* module, std::vector<std::string>* imported) {
+  if (inline_library == nullptr) {
+    return;
+  }
+  std::vector<llvm::Function*> worklist;
+  for (auto& function : *module) {
+    if (function.isDeclaration()) {
+      worklist.push_back(&function);
+    }
+  }
+  while (!worklist.empty()) {
+    llvm::Function* function = worklist.back();
+    worklist.pop_back();
+    llvm::Function* definition = inline_library->getFunction(function->getName());
+    if (definition == nullptr || definition->isDeclaration() ||
+        definition->getFunctionType() != function->getFunctionType()) {
+      continue;
+    }
+    if (cloneFunctionBody(definition, function, &worklist)) {
+      function->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      imported->push_back(function->getName());
+      LOG(DEBUG) << "import function " << function->getName().str();
+    }
+  }
+}
+
+static bool isRetainedFunction(const llvm::Function& function) {
+  return !function.isDeclaration() && !function.hasAvailableExternallyLinkage() &&
+         !function.hasLocalLinkage() && function.getName() != toy_main_function_name;
+}
+
+// Add definitions of the functions which may have inlined a function redefined in the module,
+// or a function added here, unless the module defines them too.
+static void recompileImporters(llvm::Module* module) {
+  if (importer_library == nullptr) {
+    return;
+  }
+  std::vector<std::string> worklist;
+  for (auto& function : *module) {
+    if (!function.isDeclaration()) {
+      worklist.push_back(function.getName());
+    }
+  }
+  std::set<std::string> stale;
+  while (!worklist.empty()) {
+    auto it = importers.find(worklist.back());
+    worklist.pop_back();
+    if (it == importers.end()) {
+      continue;
+    }
+    for (auto& name : it->second) {
+      if (stale.insert(name).second) {
+        worklist.push_back(name);
+      }
+    }
+    importers.erase(it);
+  }
+  for (auto& name : stale) {
+    llvm::Function* copy = importer_library->getFunction(name);
+    llvm::Function* function = module->getFunction(name);
+    if (copy == nullptr || copy->isDeclaration() ||
+        (function != nullptr && !function->isDeclaration())) {
+      continue;
+    }
+    if (function == nullptr) {
+      function = llvm::Function::Create(copy->getFunctionType(),
+                                        llvm::GlobalValue::ExternalLinkage, name, module);
+    } else if (function->getFunctionType() != copy->getFunctionType()) {
+      continue;
+    }
+    if (cloneFunctionBody(copy, function, nullptr)) {
+      LOG(DEBUG) << "recompile function " << name;
+    }
+  }
+}
+
+// Keep unoptimized copies of the functions defined in the module, without debug info, and add
+// their names to functions. Return false if a function can't be copied, then nothing should be
+// imported into the module, because the function couldn't be recompiled.
+static bool saveImporters(llvm::Module* module, std::vector<std::string>* functions) {
+  if (importer_library == nullptr) {
+    importer_library.reset(new llvm::Module("importer_library", module->getContext()));
+  }
+  for (auto& function : *module) {
+    if (!isRetainedFunction(function)) {
+      continue;
+    }
+    std::string name = function.getName();
+    // The function is redefined, so its previous copy is dropped.
+    for (auto& pair : importers) {
+      pair.second.erase(name);
+    }
+    llvm::Function* copy = importer_library->getFunction(name);
+    if (copy == nullptr) {
+      copy = llvm::Function::Create(function.getFunctionType(),
+                                    llvm::GlobalValue::ExternalLinkage, name,
+                                    importer_library.get());
+    } else {
+      copy->deleteBody();
+      if (copy->getFunctionType() != function.getFunctionType()) {
+        return false;
+      }
+    }
+    if (!cloneFunctionBody(&function, copy, nullptr)) {
+      return false;
+    }
+    llvm::stripDebugInfo(*copy);
+    functions->push_back(name);
+  }
+  return true;
+}
+
+// Import functions into the module, and remember its functions as their importers.
+static void importFunctionsTracked(llvm::Module* module) {
+  recompileImporters(module);
+  std::vector<std::string> functions;
+  std::vector<std::string> imported;
+  if (saveImporters(module, &functions)) {
+    importFunctions(module, &imported);
+  }
+  if (imported.empty()) {
+    for (auto& name : functions) {
+      importer_library->getFunction(name)->deleteBody();
+    }
+    return;
+  }
+  for (auto& name : imported) {
+    importers[name].insert(functions.begin(), functions.end());
+  }
+}
+
+// Keep optimized copies of small functions defined in the module, without debug info.
+static void retainFunctions(llvm::Module* module) {
+  if (inline_library == nullptr) {
+    inline_library.reset(new llvm::Module("inline_library", module->getContext()));
+  }
+  for (auto& function : *module) {
+    if (!isRetainedFunction(function)) {
+      continue;
+    }
+    llvm::Function* copy = inline_library->getFunction(function.getName());
+    // Don't inline a previous definition of a redefined function.
+    if (copy != nullptr && copy->getFunctionType() != function.getFunctionType()) {
+      copy->deleteBody();
+      continue;
+    }
+    if (getInstructionCount(function) > max_inline_function_size) {
+      if (copy != nullptr) {
+        copy->deleteBody();
+      }
+      continue;
+    }
+    if (copy == nullptr) {
+      copy = llvm::Function::Create(function.getFunctionType(),
+                                    llvm::GlobalValue::ExternalLinkage, function.getName(),
+                                    inline_library.get());
+    } else {
+      copy->deleteBody();
+    }
+    if (cloneFunctionBody(&function, copy, nullptr)) {
+      llvm::stripDebugInfo(*copy);
+    }
+  }
+}
 
 void prepareOptPipeline() {
 }
 
+// In tiered mode, modules are optimized and compiled at -O0 first, and hot functions are
+// optimized again at -O3 by optTierUpModule().
+static int getBaselineOptLevel() {
+  return (global_option.tiered ? 0 : global_option.opt_level);
+}
+
+// The standard pipeline of an -O level, like clang builds it. The function passes clang runs
+// before the module pipeline are added to the same pass manager, because a FunctionPassManager
+// is bound to one module. Cost models of the vectorizers and the unroller come from the target
+// machine.
+static void populatePassManager(llvm::legacy::PassManager* pass_manager, int opt_level,
+                                int size_level, llvm::TargetMachine* machine) {
+  llvm::PassManagerBuilder builder;
+  builder.OptLevel = opt_level;
+  builder.SizeLevel = size_level;
+  if (builder.OptLevel > 0) {
+    builder.Inliner = llvm::createFunctionInliningPass(builder.OptLevel, builder.SizeLevel);
+  } else {
+    builder.Inliner = llvm::createAlwaysInlinerPass();
+  }
+  // The vectorizers grow code, so they don't run when optimizing for size.
+  builder.LoopVectorize = (builder.OptLevel > 1 && builder.SizeLevel == 0);
+  builder.SLPVectorize = (builder.OptLevel > 1 && builder.SizeLevel == 0);
+  // The builder owns it, and the pass manager gets a copy.
+  builder.LibraryInfo =
+      new llvm::TargetLibraryInfoImpl(llvm::Triple(llvm::sys::getProcessTriple()));
+
+  pass_manager->add(
+      llvm::createTargetTransformInfoWrapperPass(machine->getTargetIRAnalysis()));
+  pass_manager->add(new ToyCleanupPass);
+  if (builder.OptLevel > 0) {
+    pass_manager->add(llvm::createCFGSimplificationPass());
+    pass_manager->add(llvm::createSROAPass());
+    pass_manager->add(llvm::createEarlyCSEPass());
+    pass_manager->add(llvm::createLowerExpectIntrinsicPass());
+  }
+  // Conditions are found through locals after SROA, and through results of functions after
+  // inlining, so the pass also runs after each instcombine.
+  pass_manager->add(new ToyConditionPass);
+  builder.addExtension(llvm::PassManagerBuilder::EP_Peephole, addToyConditionPass);
+  // Available externally copies imported from inline_library are dropped by the pipeline after
+  // inlining.
+  builder.populateModulePassManager(*pass_manager);
+}
+
+// Code run in the JIT is optimized for the host. Compiled files and preludes may run on other
+// machines, so they are optimized for a generic CPU of the host triple, like they are compiled.
+static std::unique_ptr<llvm::TargetMachine> target_machine;
+
+static llvm::TargetMachine* getTargetMachine() {
+  if (target_machine == nullptr) {
+    if (global_option.compile || global_option.compile_assembly ||
+        !global_option.emit_prelude_file.empty()) {
+      llvm::InitializeNativeTarget();
+      target_machine.reset(llvm::EngineBuilder().setOptLevel(getCodeGenOptLevel()).selectTarget());
+      CHECK(target_machine != nullptr) << "failed to create target machine";
+    } else {
+      target_machine.reset(createHostTargetMachine(getCodeGenOptLevel()));
+    }
+  }
+  return target_machine.get();
+}
+
+// The pipeline is built once and run on each module, so passes and immutable analyses like
+// TargetLibraryInfo are only set up once.
+static std::unique_ptr<llvm::legacy::PassManager> pass_manager;
+
+static llvm::legacy::PassManager* getPassManager() {
+  if (pass_manager == nullptr) {
+    pass_manager.reset(new llvm::legacy::PassManager);
+    populatePassManager(pass_manager.get(), getBaselineOptLevel(),
+                        (global_option.tiered ? 0 : global_option.size_level),
+                        getTargetMachine());
+  }
+  return pass_manager.get();
+}
+
 void optPipeline(llvm::Module* module) {
-  llvm::legacy::PassManager pm;
-  llvm::Pass* hello_module_pass = llvm::Pass::createPass(&HelloModulePass::ID);
-  pm.add(hello_module_pass);
-  llvm::Pass* hello_function_pass = llvm::Pass::createPass(&HelloFunctionPass::ID);
-  pm.add(hello_function_pass);
-  pm.run(*module);
+  // The vectorizers need the data layout to know the size of types.
+  module->setTargetTriple(getTargetMachine()->getTargetTriple().str());
+  module->setDataLayout(getTargetMachine()->createDataLayout());
+  // Modules don't share a context in pipeline mode, so functions can't be cloned between them.
+  // Nothing is inlined at -O0.
+  bool use_inline_library =
+      global_option.interactive && !global_option.pipeline && getBaselineOptLevel() > 0;
+  if (use_inline_library) {
+    importFunctionsTracked(module);
+  }
+  getPassManager()->run(*module);
+  if (use_inline_library) {
+    retainFunctions(module);
+  }
+}
 
-  llvm::legacy::FunctionPassManager fpm(module);
-  fpm.add(llvm::createGVNPass(false));
-  fpm.add(llvm::createPromoteMemoryToRegisterPass());
-  fpm.doInitialization();
+// Hot functions are rare, so the pass manager isn't kept. It runs on the tier up thread, in a
+// context of its own, and with the target machine of the thread, because target machines cache
+// subtargets without a lock.
+void optTierUpModule(llvm::Module* module, llvm::TargetMachine* machine) {
+  llvm::legacy::PassManager tier_up_pass_manager;
+  populatePassManager(&tier_up_pass_manager, 3, 0, machine);
+  tier_up_pass_manager.run(*module);
+}
+
+llvm::CodeGenOpt::Level getCodeGenOptLevel() {
+  switch (getBaselineOptLevel()) {
+    case 0:
+      return llvm::CodeGenOpt::None;
+    case 1:
+      return llvm::CodeGenOpt::Less;
+    case 2:
+      return llvm::CodeGenOpt::Default;
+    default:
+      return llvm::CodeGenOpt::Aggressive;
+  }
+}
 
-  for (auto it = module->begin(); it != module->end(); ++it) {
-    llvm::Function& function = *it;
-    fpm.run(function);
+llvm::TargetMachine* createHostTargetMachine(llvm::CodeGenOpt::Level level) {
+  llvm::InitializeNativeTarget();
+  llvm::SmallVector<std::string, 32> attrs;
+  llvm::StringMap<bool> features;
+  if (llvm::sys::getHostCPUFeatures(features)) {
+    for (auto& feature : features) {
+      attrs.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+    }
   }
+  llvm::TargetMachine* machine = llvm::EngineBuilder()
+                                     .setOptLevel(level)
+                                     .setMCPU(llvm::sys::getHostCPUName())
+                                     .setMAttrs(attrs)
+                                     .selectTarget();
+  CHECK(machine != nullptr) << "failed to create target machine for the host";
+  return machine;
 }
 
 void finishOptPipeline() {
+  inline_library.reset(nullptr);
+  importer_library.reset(nullptr);
+  importers.clear();
+  pass_manager.reset(nullptr);
+  target_machine.reset(nullptr);
 }
 
 void optMain(llvm::Module* module) {
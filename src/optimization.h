@@ -2,6 +2,8 @@
 #define TOY_OPTIMIZATION_H_
 
 #include <llvm/IR/Module.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Target/TargetMachine.h>
 
 // Used in interactive mode.
 void prepareOptPipeline();
@@ -11,4 +13,15 @@ void finishOptPipeline();
 // Used in non-interactive mode.
 void optMain(llvm::Module* module);
 
+// Used in tiered mode. Optimize a module extracted from a hot function at -O3, for the target
+// machine compiling it.
+void optTierUpModule(llvm::Module* module, llvm::TargetMachine* target_machine);
+
+// The code generation level of the -O option, used by both the JIT and compileMain(). It is -O0
+// for the baseline code in tiered mode.
+llvm::CodeGenOpt::Level getCodeGenOptLevel();
+
+// Create a target machine with the CPU name and features of the host, for code run in the JIT.
+llvm::TargetMachine* createHostTargetMachine(llvm::CodeGenOpt::Level level);
+
 #endif  // TOY_OPTIMIZATION_H_
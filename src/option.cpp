@@ -17,12 +17,19 @@ Option::Option()
       dump_token(false),
       dump_ast(false),
       dump_code(false),
+      dump_mem(false),
       log_level(INFO),
       execute(false),
+      opt_level(2),
+      size_level(0),
       compile(false),
       compile_assembly(false),
       debug(false),
-      debug_pass(false) {
+      debug_pass(false),
+      pipeline(false),
+      tiered(false),
+      tier_up_threshold(10000),
+      auto_parallel(false) {
 }
 
 std::string Option::str() const {
@@ -33,13 +40,25 @@ std::string Option::str() const {
      << "              dump_token = " << dump_token << "\n"
      << "              dump_ast = " << dump_ast << "\n"
      << "              dump_code = " << dump_code << "\n"
+     << "              dump_mem = " << dump_mem << "\n"
      << "              log_level = " << log_level << "\n"
      << "              execute = " << execute << "\n"
+     << "              opt_level = " << opt_level << "\n"
+     << "              size_level = " << size_level << "\n"
      << "              compile = " << compile << "\n"
      << "              compile_output_file = " << compile_output_file << "\n"
      << "              compile_assembly = " << compile_assembly << "\n"
      << "              compile_assembly_output_file = " << compile_assembly_output_file << "\n"
      << "              debug = " << debug << "\n"
-     << "              debug_pass = " << debug_pass << "\n";
+     << "              debug_pass = " << debug_pass << "\n"
+     << "              pipeline = " << pipeline << "\n"
+     << "              restore_file = " << restore_file << "\n"
+     << "              prelude_file = " << prelude_file << "\n"
+     << "              emit_prelude_file = " << emit_prelude_file << "\n"
+     << "              tiered = " << tiered << "\n"
+     << "              tier_up_threshold = " << tier_up_threshold << "\n"
+     << "              profile_generate_file = " << profile_generate_file << "\n"
+     << "              profile_use_file = " << profile_use_file << "\n"
+     << "              auto_parallel = " << auto_parallel << "\n";
   return os.str();
 }
@@ -1,6 +1,7 @@
 #ifndef TOY_OPTION_H_
 #define TOY_OPTION_H_
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string>
 
@@ -17,14 +18,30 @@ struct Option {
   bool dump_token;
   bool dump_ast;
   bool dump_code;
+  bool dump_mem;
   LogSeverity log_level;
   bool execute;
+  // Set by -O0 to -O3 and -Os.
+  int opt_level;
+  int size_level;
   bool compile;
   std::string compile_output_file;
   bool compile_assembly;
   std::string compile_assembly_output_file;
   bool debug;
   bool debug_pass;
+  bool pipeline;
+  std::string restore_file;
+  std::string prelude_file;
+  std::string emit_prelude_file;
+  // Set by --tiered, functions are recompiled at -O3 after being called or looping
+  // tier_up_threshold times.
+  bool tiered;
+  uint64_t tier_up_threshold;
+  std::string profile_generate_file;
+  std::string profile_use_file;
+  // Set by --auto-parallel, top level for loops with independent iterations run on all cores.
+  bool auto_parallel;
 
   Option();
 
@@ -0,0 +1,424 @@
+#include "parallel.h"
+
+#include <math.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "logging.h"
+#include "parse.h"
+
+// Limits of the begin and step of int counters, see type_inference.cpp.
+static const double max_exact_integer = 9007199254740992.0;
+static const double max_counter_step = 1024.0;
+
+struct FunctionInfo {
+  FunctionInfo() : is_pure(true), definition_count(0) {
+  }
+
+  bool is_pure;
+  size_t definition_count;
+  std::set<std::string> callees;
+  // Names of variables read by the function, including its arguments and locals.
+  std::set<std::string> read_names;
+};
+
+// Functions defined or declared by the program. Only functions defined once can be pure.
+static std::map<std::string, FunctionInfo> function_infos;
+// Names assigned at top level out of for loops, which are the only assignments creating global
+// variables.
+static std::set<std::string> global_names;
+
+static bool isVariable(ExprAST* expr, const std::string& name) {
+  return expr->type() == VARIABLE_EXPR_AST &&
+         reinterpret_cast<VariableExprAST*>(expr)->getName() == name;
+}
+
+static bool getIntegralNumber(ExprAST* expr, double max_abs, int64_t* val) {
+  if (expr->type() != NUMBER_EXPR_AST) {
+    return false;
+  }
+  double number = reinterpret_cast<NumberExprAST*>(expr)->getVal();
+  if (number != floor(number) || fabs(number) > max_abs) {
+    return false;
+  }
+  *val = static_cast<int64_t>(number);
+  return true;
+}
+
+// Binary operators are calls when the program defines them, like codegen does. Unary operators
+// other than - are always calls.
+static bool isBuiltinBinaryOp(const std::string& op) {
+  return function_infos.find("binary" + op) == function_infos.end();
+}
+
+// Return the function called by expr, or an empty string if it calls none.
+static std::string getCallee(ExprAST* expr) {
+  if (expr->type() == CALL_EXPR_AST) {
+    return reinterpret_cast<CallExprAST*>(expr)->getCallee();
+  }
+  if (expr->type() == UNARY_EXPR_AST) {
+    const std::string& op = reinterpret_cast<UnaryExprAST*>(expr)->getOp().desc;
+    return (op == "-" ? "" : "unary" + op);
+  }
+  if (expr->type() == BINARY_EXPR_AST) {
+    const std::string& op = reinterpret_cast<BinaryExprAST*>(expr)->getOp().desc;
+    return (isBuiltinBinaryOp(op) ? "" : "binary" + op);
+  }
+  return "";
+}
+
+static bool isPureFunction(const std::string& name) {
+  auto it = function_infos.find(name);
+  return it != function_infos.end() && it->second.is_pure && it->second.definition_count == 1;
+}
+
+static void collectGlobalNames(ExprAST* expr) {
+  if (expr->type() == FUNCTION_AST || expr->type() == FOR_EXPR_AST) {
+    return;
+  }
+  if (expr->type() == ASSIGNMENT_EXPR_AST) {
+    global_names.insert(reinterpret_cast<AssignmentExprAST*>(expr)->getVarName());
+  }
+  for (auto child : expr->getChildren()) {
+    collectGlobalNames(child);
+  }
+}
+
+// Arguments and locals of a function are found before global variables, so only assigning a
+// name which may be a global variable makes the function impure.
+static void collectFunctionInfo(ExprAST* expr, const std::set<std::string>& args,
+                                FunctionInfo* info) {
+  std::string callee = getCallee(expr);
+  if (!callee.empty()) {
+    info->callees.insert(callee);
+  }
+  if (expr->type() == VARIABLE_EXPR_AST) {
+    info->read_names.insert(reinterpret_cast<VariableExprAST*>(expr)->getName());
+  } else if (expr->type() == ASSIGNMENT_EXPR_AST) {
+    const std::string& name = reinterpret_cast<AssignmentExprAST*>(expr)->getVarName();
+    if (args.find(name) == args.end() && global_names.find(name) != global_names.end()) {
+      info->is_pure = false;
+    }
+  }
+  for (auto child : expr->getChildren()) {
+    collectFunctionInfo(child, args, info);
+  }
+}
+
+// A function is pure if it doesn't assign global variables and only calls pure functions.
+// Functions only declared, like print and printd, aren't pure.
+static void inferPureFunctions(const std::vector<ExprAST*>& exprs) {
+  for (auto expr : exprs) {
+    collectGlobalNames(expr);
+  }
+  for (auto expr : exprs) {
+    if (expr->type() == PROTOTYPE_AST) {
+      function_infos[reinterpret_cast<PrototypeAST*>(expr)->getName()];
+    } else if (expr->type() == FUNCTION_AST) {
+      FunctionAST* function = reinterpret_cast<FunctionAST*>(expr);
+      function_infos[function->getPrototype()->getName()].definition_count++;
+    }
+  }
+  for (auto expr : exprs) {
+    if (expr->type() == FUNCTION_AST) {
+      FunctionAST* function = reinterpret_cast<FunctionAST*>(expr);
+      PrototypeAST* prototype = function->getPrototype();
+      std::set<std::string> args(prototype->getArgs().begin(), prototype->getArgs().end());
+      collectFunctionInfo(function->getBody(), args, &function_infos[prototype->getName()]);
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto& pair : function_infos) {
+      FunctionInfo& info = pair.second;
+      if (!info.is_pure) {
+        continue;
+      }
+      for (auto& callee : info.callees) {
+        if (!isPureFunction(callee)) {
+          info.is_pure = false;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// Collect names read by the function and the functions it calls.
+static void collectCalleeReadNames(const std::string& name, std::set<std::string>* visited,
+                                   std::set<std::string>* read_names) {
+  if (!visited->insert(name).second) {
+    return;
+  }
+  const FunctionInfo& info = function_infos[name];
+  read_names->insert(info.read_names.begin(), info.read_names.end());
+  for (auto& callee : info.callees) {
+    collectCalleeReadNames(callee, visited, read_names);
+  }
+}
+
+struct LoopBodyInfo {
+  LoopBodyInfo() : is_supported(true) {
+  }
+
+  bool is_supported;
+  std::map<std::string, size_t> reads;
+  std::map<std::string, size_t> assignments;
+  // Assignments like v = v + e.
+  std::map<std::string, size_t> sum_updates;
+  std::set<std::string> callees;
+};
+
+static void collectLoopBodyInfo(ExprAST* expr, LoopBodyInfo* info) {
+  std::string callee = getCallee(expr);
+  if (!callee.empty()) {
+    info->callees.insert(callee);
+  }
+  if (expr->type() == VARIABLE_EXPR_AST) {
+    info->reads[reinterpret_cast<VariableExprAST*>(expr)->getName()]++;
+  } else if (expr->type() == ASSIGNMENT_EXPR_AST) {
+    AssignmentExprAST* assignment = reinterpret_cast<AssignmentExprAST*>(expr);
+    const std::string& name = assignment->getVarName();
+    info->assignments[name]++;
+    ExprAST* right = assignment->getRight();
+    if (right->type() == BINARY_EXPR_AST) {
+      BinaryExprAST* binary = reinterpret_cast<BinaryExprAST*>(right);
+      if (binary->getOp().desc == "+" && isBuiltinBinaryOp("+") &&
+          (isVariable(binary->getLeft(), name) || isVariable(binary->getRight(), name))) {
+        info->sum_updates[name]++;
+      }
+    }
+  } else if (expr->type() == FUNCTION_AST || expr->type() == PROTOTYPE_AST ||
+             expr->type() == COMMAND_AST) {
+    info->is_supported = false;
+  }
+  for (auto child : expr->getChildren()) {
+    collectLoopBodyInfo(child, info);
+  }
+}
+
+// Check each variable created by the body is assigned before being read in each iteration.
+// Assigned holds the variables assigned on all paths to expr. Parts which may not run, like if
+// branches and loop bodies, are checked with a copy of it.
+static bool isAssignedBeforeRead(ExprAST* expr, const std::set<std::string>& body_variables,
+                                 std::set<std::string>* assigned) {
+  std::vector<ExprAST*> children = expr->getChildren();
+  switch (expr->type()) {
+    case VARIABLE_EXPR_AST: {
+      const std::string& name = reinterpret_cast<VariableExprAST*>(expr)->getName();
+      return body_variables.find(name) == body_variables.end() ||
+             assigned->find(name) != assigned->end();
+    }
+    case ASSIGNMENT_EXPR_AST: {
+      AssignmentExprAST* assignment = reinterpret_cast<AssignmentExprAST*>(expr);
+      if (!isAssignedBeforeRead(assignment->getRight(), body_variables, assigned)) {
+        return false;
+      }
+      if (body_variables.find(assignment->getVarName()) != body_variables.end()) {
+        assigned->insert(assignment->getVarName());
+      }
+      return true;
+    }
+    case IF_EXPR_AST: {
+      // The first condition always runs.
+      if (!isAssignedBeforeRead(children[0], body_variables, assigned)) {
+        return false;
+      }
+      for (size_t i = 1; i < children.size(); ++i) {
+        std::set<std::string> branch_assigned = *assigned;
+        if (!isAssignedBeforeRead(children[i], body_variables, &branch_assigned)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case FOR_EXPR_AST: {
+      ForExprAST* loop = reinterpret_cast<ForExprAST*>(expr);
+      if (!isAssignedBeforeRead(loop->getInitExpr(), body_variables, assigned)) {
+        return false;
+      }
+      std::set<std::string> cond_assigned = *assigned;
+      std::set<std::string> loop_assigned = *assigned;
+      return isAssignedBeforeRead(loop->getCondExpr(), body_variables, &cond_assigned) &&
+             isAssignedBeforeRead(loop->getBlockExpr(), body_variables, &loop_assigned) &&
+             isAssignedBeforeRead(loop->getNextExpr(), body_variables, &loop_assigned);
+    }
+    default: {
+      // Other expressions evaluate their children in order.
+      for (auto child : children) {
+        if (!isAssignedBeforeRead(child, body_variables, assigned)) {
+          return false;
+        }
+      }
+      return true;
+    }
+  }
+}
+
+// Match for (i = begin; i < end; i = i + step), or the same with i <= end, end > i, end >= i or
+// i = step + i. Type inference must have made i an int counter.
+static bool matchLoopBounds(ForExprAST* loop, ParallelLoop* result) {
+  ExprAST* init = loop->getInitExpr();
+  if (init->type() != ASSIGNMENT_EXPR_AST) {
+    return false;
+  }
+  AssignmentExprAST* init_assignment = reinterpret_cast<AssignmentExprAST*>(init);
+  const std::string& index_name = init_assignment->getVarName();
+  if (init_assignment->getValueType() != VALUE_TYPE_INT ||
+      !getIntegralNumber(init_assignment->getRight(), max_exact_integer, &result->begin)) {
+    return false;
+  }
+
+  ExprAST* cond = loop->getCondExpr();
+  if (cond->type() != BINARY_EXPR_AST) {
+    return false;
+  }
+  BinaryExprAST* compare = reinterpret_cast<BinaryExprAST*>(cond);
+  const std::string& op = compare->getOp().desc;
+  if (!isBuiltinBinaryOp(op)) {
+    return false;
+  }
+  if ((op == "<" || op == "<=") && isVariable(compare->getLeft(), index_name)) {
+    result->end = compare->getRight();
+  } else if ((op == ">" || op == ">=") && isVariable(compare->getRight(), index_name)) {
+    result->end = compare->getLeft();
+  } else {
+    return false;
+  }
+  result->inclusive_end = (op == "<=" || op == ">=");
+
+  ExprAST* next = loop->getNextExpr();
+  if (next->type() != ASSIGNMENT_EXPR_AST) {
+    return false;
+  }
+  AssignmentExprAST* next_assignment = reinterpret_cast<AssignmentExprAST*>(next);
+  if (next_assignment->getVarName() != index_name ||
+      next_assignment->getRight()->type() != BINARY_EXPR_AST) {
+    return false;
+  }
+  BinaryExprAST* update = reinterpret_cast<BinaryExprAST*>(next_assignment->getRight());
+  if (update->getOp().desc != "+" || !isBuiltinBinaryOp("+")) {
+    return false;
+  }
+  ExprAST* step = nullptr;
+  if (isVariable(update->getLeft(), index_name)) {
+    step = update->getRight();
+  } else if (isVariable(update->getRight(), index_name)) {
+    step = update->getLeft();
+  } else {
+    return false;
+  }
+  if (!getIntegralNumber(step, max_counter_step, &result->step) || result->step <= 0) {
+    return false;
+  }
+  result->index_name = index_name;
+  result->body = loop->getBlockExpr();
+  return true;
+}
+
+static bool analyzeLoop(ForExprAST* loop, ParallelLoop* result) {
+  if (!matchLoopBounds(loop, result)) {
+    return false;
+  }
+  const std::string& index_name = result->index_name;
+  LoopBodyInfo body_info;
+  collectLoopBodyInfo(result->body, &body_info);
+  if (!body_info.is_supported || body_info.assignments.count(index_name) != 0) {
+    return false;
+  }
+  std::set<std::string> reductions;
+  std::set<std::string> body_variables;
+  for (auto& pair : body_info.assignments) {
+    const std::string& name = pair.first;
+    // Each read of a reduction is in one of its updates.
+    if (body_info.sum_updates[name] == pair.second && body_info.reads[name] == pair.second) {
+      reductions.insert(name);
+    } else {
+      body_variables.insert(name);
+    }
+  }
+  std::set<std::string> assigned;
+  if (!isAssignedBeforeRead(result->body, body_variables, &assigned)) {
+    return false;
+  }
+
+  // The end is only evaluated once, so it can't depend on the iterations.
+  LoopBodyInfo end_info;
+  collectLoopBodyInfo(result->end, &end_info);
+  if (!end_info.is_supported || !end_info.assignments.empty()) {
+    return false;
+  }
+  for (auto& pair : end_info.reads) {
+    if (pair.first == index_name || body_info.assignments.count(pair.first) != 0) {
+      return false;
+    }
+  }
+
+  std::set<std::string> callees = body_info.callees;
+  callees.insert(end_info.callees.begin(), end_info.callees.end());
+  std::set<std::string> visited;
+  std::set<std::string> callee_read_names;
+  for (auto& callee : callees) {
+    if (!isPureFunction(callee)) {
+      return false;
+    }
+    collectCalleeReadNames(callee, &visited, &callee_read_names);
+  }
+  // Functions would see the reductions before the partial sums are added.
+  for (auto& name : reductions) {
+    if (callee_read_names.find(name) != callee_read_names.end()) {
+      return false;
+    }
+  }
+
+  std::set<std::string> captured;
+  for (auto& pair : body_info.reads) {
+    captured.insert(pair.first);
+  }
+  for (auto& pair : end_info.reads) {
+    captured.insert(pair.first);
+  }
+  captured.erase(index_name);
+  for (auto& pair : body_info.assignments) {
+    captured.erase(pair.first);
+  }
+  result->reductions.assign(reductions.begin(), reductions.end());
+  result->body_variables.assign(body_variables.begin(), body_variables.end());
+  result->captured_variables.assign(captured.begin(), captured.end());
+  return true;
+}
+
+static void findTopLevelLoops(ExprAST* expr, std::unordered_map<ExprAST*, ParallelLoop>* loops) {
+  if (expr->type() == FUNCTION_AST || expr->type() == PROTOTYPE_AST) {
+    return;
+  }
+  if (expr->type() == FOR_EXPR_AST) {
+    ParallelLoop loop;
+    if (analyzeLoop(reinterpret_cast<ForExprAST*>(expr), &loop)) {
+      LOG(DEBUG) << "find parallel loop of " << loop.index_name << ", loc "
+                 << expr->getLoc().toString();
+      (*loops)[expr] = loop;
+    }
+    return;
+  }
+  for (auto child : expr->getChildren()) {
+    findTopLevelLoops(child, loops);
+  }
+}
+
+std::unordered_map<ExprAST*, ParallelLoop> findParallelLoops(const std::vector<ExprAST*>& exprs) {
+  std::unordered_map<ExprAST*, ParallelLoop> loops;
+  inferPureFunctions(exprs);
+  for (auto expr : exprs) {
+    findTopLevelLoops(expr, &loops);
+  }
+  function_infos.clear();
+  global_names.clear();
+  return loops;
+}
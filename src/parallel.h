@@ -0,0 +1,38 @@
+#ifndef TOY_PARALLEL_H_
+#define TOY_PARALLEL_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class ExprAST;
+
+// A top level loop like for (i = begin; i < end; i = i + step) body, whose iterations can run in
+// any order on different threads with --auto-parallel. The body and end only call pure
+// functions, which don't print or assign global variables. Variables the body creates are
+// assigned before being read in each iteration, so no value is carried between iterations.
+struct ParallelLoop {
+  std::string index_name;
+  int64_t begin;
+  ExprAST* end;
+  // Set for i <= end.
+  bool inclusive_end;
+  int64_t step;
+  ExprAST* body;
+  // Variables only updated like v = v + e, where e doesn't read v. Each thread sums its
+  // iterations from -0.0, and the partial sums are added to the variables in iteration order.
+  std::vector<std::string> reductions;
+  // Variables created by the body.
+  std::vector<std::string> body_variables;
+  // Variables read by the loop and not assigned in it. Their values are copied to the threads.
+  std::vector<std::string> captured_variables;
+};
+
+// Find the top level for loops of a program which can run in parallel. Whether names refer to
+// variables existing before a loop is only known when generating code, so codegen checks the
+// variables before running a loop in parallel.
+std::unordered_map<ExprAST*, ParallelLoop> findParallelLoops(const std::vector<ExprAST*>& exprs);
+
+#endif  // TOY_PARALLEL_H_
@@ -1,6 +1,8 @@
 #include "parse.h"
 
+#include <inttypes.h>
 #include <stdio.h>
+#include <map>
 #include <memory>
 #include <set>
 #include <unordered_map>
@@ -43,8 +45,22 @@ static const std::unordered_map<int, std::string> expr_ast_type_name_map = {
     {PROTOTYPE_AST, "PrototypeAST"},        {FUNCTION_AST, "FunctionAST"},
     {CALL_EXPR_AST, "CallExprAST"},         {IF_EXPR_AST, "IfExprAST"},
     {BLOCK_EXPR_AST, "BlockExprAST"},       {FOR_EXPR_AST, "ForExprAST"},
+    {COMMAND_AST, "CommandAST"},
 };
 
+static const std::unordered_map<std::string, ValueType> value_type_map = {
+    {"double", VALUE_TYPE_DOUBLE}, {"int", VALUE_TYPE_INT}, {"bool", VALUE_TYPE_BOOL},
+};
+
+const char* getValueTypeName(ValueType type) {
+  for (auto& pair : value_type_map) {
+    if (pair.second == type) {
+      return pair.first.c_str();
+    }
+  }
+  return "unknown";
+}
+
 std::string ExprAST::dumpHeader() const {
   return stringPrintf("%s (Line %zu, Column %zu)",
                       expr_ast_type_name_map.find(type_)->second.c_str(), loc_.line, loc_.column);
@@ -74,15 +90,18 @@ void BinaryExprAST::dump(int indent) const {
 }
 
 void AssignmentExprAST::dump(int indent) const {
-  fprintIndented(stderr, indent, "%s: name = %s\n", dumpHeader().c_str(), var_name_.c_str());
+  fprintIndented(stderr, indent, "%s: name = %s, type = %s\n", dumpHeader().c_str(),
+                 var_name_.c_str(), getValueTypeName(value_type_));
   right_->dump(indent + 1);
 }
 
 void PrototypeAST::dump(int indent) const {
   fprintIndented(stderr, indent, "%s: %s (", dumpHeader().c_str(), name_.c_str());
   for (size_t i = 0; i < args_.size(); ++i) {
-    fprintf(stderr, "%s%s", args_[i].c_str(), (i == args_.size() - 1) ? ")\n" : ", ");
+    fprintf(stderr, "%s%s: %s", (i == 0 ? "" : ", "), args_[i].c_str(),
+            getValueTypeName(arg_types_[i]));
   }
+  fprintf(stderr, "): %s\n", getValueTypeName(return_type_));
 }
 
 void FunctionAST::dump(int indent) const {
@@ -134,8 +153,98 @@ void ForExprAST::dump(int indent) const {
   block_expr_->dump(indent + 2);
 }
 
+void CommandAST::dump(int indent) const {
+  if (command_ == COMMAND_JOB) {
+    fprintIndented(stderr, indent, "%s: job\n", dumpHeader().c_str());
+    expr_->dump(indent + 1);
+  } else if (command_ == COMMAND_WAIT) {
+    fprintIndented(stderr, indent, "%s: wait %" PRIu64 "\n", dumpHeader().c_str(), job_id_);
+  } else if (command_ == COMMAND_JOBS) {
+    fprintIndented(stderr, indent, "%s: jobs\n", dumpHeader().c_str());
+  } else if (command_ == COMMAND_SAVE) {
+    fprintIndented(stderr, indent, "%s: save %s\n", dumpHeader().c_str(), path_.c_str());
+  } else {
+    fprintIndented(stderr, indent, "%s: mem\n", dumpHeader().c_str());
+  }
+}
+
+std::vector<ExprAST*> NumberExprAST::getChildren() const {
+  return std::vector<ExprAST*>();
+}
+
+std::vector<ExprAST*> StringLiteralExprAST::getChildren() const {
+  return std::vector<ExprAST*>();
+}
+
+std::vector<ExprAST*> VariableExprAST::getChildren() const {
+  return std::vector<ExprAST*>();
+}
+
+std::vector<ExprAST*> UnaryExprAST::getChildren() const {
+  return std::vector<ExprAST*>({right_});
+}
+
+std::vector<ExprAST*> BinaryExprAST::getChildren() const {
+  return std::vector<ExprAST*>({left_, right_});
+}
+
+std::vector<ExprAST*> AssignmentExprAST::getChildren() const {
+  return std::vector<ExprAST*>({right_});
+}
+
+std::vector<ExprAST*> PrototypeAST::getChildren() const {
+  return std::vector<ExprAST*>();
+}
+
+std::vector<ExprAST*> FunctionAST::getChildren() const {
+  return std::vector<ExprAST*>({body_});
+}
+
+std::vector<ExprAST*> CallExprAST::getChildren() const {
+  return args_;
+}
+
+std::vector<ExprAST*> IfExprAST::getChildren() const {
+  std::vector<ExprAST*> children;
+  for (auto& pair : cond_then_exprs_) {
+    children.push_back(pair.first);
+    children.push_back(pair.second);
+  }
+  if (else_expr_ != nullptr) {
+    children.push_back(else_expr_);
+  }
+  return children;
+}
+
+std::vector<ExprAST*> BlockExprAST::getChildren() const {
+  return exprs_;
+}
+
+std::vector<ExprAST*> ForExprAST::getChildren() const {
+  return std::vector<ExprAST*>({init_expr_, cond_expr_, next_expr_, block_expr_});
+}
+
+std::vector<ExprAST*> CommandAST::getChildren() const {
+  return (expr_ != nullptr ? std::vector<ExprAST*>({expr_}) : std::vector<ExprAST*>());
+}
+
 static ExprAST* parseExpression();
 
+// ValueType := int
+//           := double
+//           := bool
+static ValueType parseValueType() {
+  Token curr = currToken();
+  if (curr.type == TOKEN_IDENTIFIER) {
+    auto it = value_type_map.find(curr.identifier);
+    if (it != value_type_map.end()) {
+      return it->second;
+    }
+  }
+  LOG(FATAL) << "Unexpected type " << curr.toString();
+  return VALUE_TYPE_DOUBLE;
+}
+
 // Primary := identifier
 //         := number
 //         := string_literal
@@ -221,22 +330,31 @@ static ExprAST* parseUnaryExpression() {
   return parsePrimary();
 }
 
-static std::map<std::string, int> op_priority_map = {
-    {"<", 10},  {"<=", 10}, {"==", 10}, {"!=", 10}, {">", 10},
-    {">=", 10}, {"+", 20},  {"-", 20},  {"*", 30},  {"/", 30},
+static const std::map<std::string, int> builtin_op_priority_map = {
+    {"|", 4},   {"^", 5},   {"&", 6},   {"<", 10},  {"<=", 10}, {"==", 10}, {"!=", 10},
+    {">", 10},  {">=", 10}, {"<<", 15}, {">>", 15}, {"+", 20},  {"-", 20},  {"*", 30},
+    {"/", 30},  {"%", 30},
 };
 
+static std::map<std::string, int> op_priority_map = builtin_op_priority_map;
+
 // BinaryExpression := UnaryExpression
+//                  := BinaryExpression | BinaryExpression
+//                  := BinaryExpression ^ BinaryExpression
+//                  := BinaryExpression & BinaryExpression
 //                  := BinaryExpression < BinaryExpression
 //                  := BinaryExpression <= BinaryExpression
 //                  := BinaryExpression == BinaryExpression
 //                  := BinaryExpression != BinaryExpression
 //                  := BinaryExpression > BinaryExpression
 //                  := BinaryExpression >= BinaryExpression
+//                  := BinaryExpression << BinaryExpression
+//                  := BinaryExpression >> BinaryExpression
 //                  := BinaryExpression + BinaryExpression
 //                  := BinaryExpression - BinaryExpression
 //                  := BinaryExpression * BinaryExpression
 //                  := BinaryExpression / BinaryExpression
+//                  := BinaryExpression % BinaryExpression
 //                  := BinaryExpression user_defined_binary_op_letter
 //                  BinaryExpression
 static ExprAST* parseBinaryExpression(int prev_priority = -1) {
@@ -265,16 +383,29 @@ static ExprAST* parseBinaryExpression(int prev_priority = -1) {
 
 // Expression := BinaryExpression
 //            := identifier = Expression
+//            := identifier : ValueType = Expression
 static ExprAST* parseExpression() {
   Token curr = currToken();
   if (curr.type == TOKEN_IDENTIFIER) {
     std::string var_name = curr.identifier;
     nextToken();
+    bool has_declared_type = false;
+    ValueType declared_type = VALUE_TYPE_DOUBLE;
+    if (isLetterToken(':')) {
+      nextToken();
+      declared_type = parseValueType();
+      has_declared_type = true;
+      nextToken();
+      CHECK(isLetterToken('=')) << currToken().toString();
+    }
     if (isLetterToken('=')) {
       nextToken();
       ExprAST* expr = parseExpression();
       CHECK(expr != nullptr);
       AssignmentExprAST* assign_expr = new AssignmentExprAST(var_name, expr, curr.loc);
+      if (has_declared_type) {
+        assign_expr->setDeclaredType(declared_type);
+      }
       expr_storage.push_back(std::unique_ptr<ExprAST>(assign_expr));
       return assign_expr;
     }
@@ -377,9 +508,26 @@ static ExprAST* parseStatement() {
   return nullptr;
 }
 
-// FunctionPrototype := identifier ( identifier1,identifier2,... )
-//                   := binary letter [priority] ( identifier1,identifier2,... )
-//                   := unary letter ( identifier1,identifier2,... )
+// Single character builtin operators added with int types. They were letters before, so user
+// operators defined on them still override the builtin ones.
+static const std::set<std::string> redefinable_ops = {"%", "&", "|", "^"};
+
+// Return the letter of a user defined operator.
+static char getOpLetter() {
+  Token curr = currToken();
+  if (curr.type == TOKEN_OP) {
+    CHECK(redefinable_ops.find(curr.op.desc) != redefinable_ops.end())
+        << "Can't redefine operator " << curr.op.desc << ", loc " << curr.loc.toString();
+    return curr.op.desc[0];
+  }
+  CHECK_EQ(TOKEN_LETTER, curr.type);
+  return curr.letter;
+}
+
+// FunctionPrototype := identifier ( Arg1,Arg2,... ) [: ValueType]
+//                   := binary letter [priority] ( Arg1,Arg2,... ) [: ValueType]
+//                   := unary letter ( Arg1,Arg2,... ) [: ValueType]
+// Arg := identifier [: ValueType]
 static PrototypeAST* parseFunctionPrototype() {
   Token curr = currToken();
   std::string function_name;
@@ -393,9 +541,8 @@ static PrototypeAST* parseFunctionPrototype() {
     nextToken();
   } else if (curr.type == TOKEN_BINARY) {
     nextToken();
-    CHECK_EQ(TOKEN_LETTER, currToken().type);
     is_binary_op = true;
-    binary_op_letter = currToken().letter;
+    binary_op_letter = getOpLetter();
     function_name = "binary" + std::string(1, binary_op_letter);
     nextToken();
     if (currToken().type == TOKEN_NUMBER) {
@@ -404,20 +551,27 @@ static PrototypeAST* parseFunctionPrototype() {
     }
   } else if (curr.type == TOKEN_UNARY) {
     nextToken();
-    CHECK_EQ(TOKEN_LETTER, currToken().type);
     is_unary_op = true;
-    unary_op_letter = currToken().letter;
+    unary_op_letter = getOpLetter();
     function_name = "unary" + std::string(1, unary_op_letter);
     nextToken();
   }
   CHECK(isLetterToken('('));
   std::vector<std::string> args;
+  std::vector<ValueType> arg_types;
   nextToken();
   if (!isLetterToken(')')) {
     while (true) {
       CHECK_EQ(TOKEN_IDENTIFIER, currToken().type);
       args.push_back(currToken().identifier);
       nextToken();
+      ValueType arg_type = VALUE_TYPE_DOUBLE;
+      if (isLetterToken(':')) {
+        nextToken();
+        arg_type = parseValueType();
+        nextToken();
+      }
+      arg_types.push_back(arg_type);
       if (isLetterToken(',')) {
         nextToken();
       } else if (isLetterToken(')')) {
@@ -428,19 +582,57 @@ static PrototypeAST* parseFunctionPrototype() {
     }
   }
   nextToken();
-  PrototypeAST* prototype = new PrototypeAST(function_name, args, curr.loc);
+  ValueType return_type = VALUE_TYPE_DOUBLE;
+  if (isLetterToken(':')) {
+    nextToken();
+    return_type = parseValueType();
+    nextToken();
+  }
+  PrototypeAST* prototype = new PrototypeAST(function_name, args, arg_types, return_type, curr.loc);
   expr_storage.push_back(std::unique_ptr<ExprAST>(prototype));
 
   if (is_binary_op) {
-    addDynamicOp(binary_op_letter);
-    op_priority_map[std::string(1, binary_op_letter)] = binary_op_priority;
+    defineUserOp(UserDefinedOp{binary_op_letter, true, binary_op_priority});
   } else if (is_unary_op) {
-    addDynamicOp(unary_op_letter);
-    unary_op_set.insert(std::string(1, unary_op_letter));
+    defineUserOp(UserDefinedOp{unary_op_letter, false, 0});
   }
   return prototype;
 }
 
+static std::vector<UserDefinedOp> user_defined_ops;
+static std::vector<UserDefinedOp> prelude_ops;
+
+const std::vector<UserDefinedOp>& getUserDefinedOps() {
+  return user_defined_ops;
+}
+
+void defineUserOp(const UserDefinedOp& op) {
+  bool is_letter_defined = false;
+  for (auto& defined_op : user_defined_ops) {
+    is_letter_defined |= (defined_op.letter == op.letter);
+  }
+  // Restored snapshots may define operators of the prelude again.
+  if (!is_letter_defined) {
+    addDynamicOp(op.letter);
+  }
+  if (op.is_binary) {
+    op_priority_map[std::string(1, op.letter)] = op.priority;
+  } else {
+    unary_op_set.insert(std::string(1, op.letter));
+  }
+  for (auto& defined_op : user_defined_ops) {
+    if (defined_op.letter == op.letter && defined_op.is_binary == op.is_binary) {
+      defined_op = op;
+      return;
+    }
+  }
+  user_defined_ops.push_back(op);
+}
+
+void addPreludeOp(const UserDefinedOp& op) {
+  prelude_ops.push_back(op);
+}
+
 // Extern := extern FunctionPrototype ;
 static PrototypeAST* parseExtern() {
   Token curr = currToken();
@@ -464,9 +656,53 @@ static FunctionAST* parseFunction() {
   return function;
 }
 
+// Command := : job Statement
+//         := : wait Number
+//         := : jobs
+//         := : save StringLiteral
+static CommandAST* parseCommand() {
+  Token curr = currToken();
+  CHECK(isLetterToken(':'));
+  CHECK(global_option.interactive) << "Commands are only supported in interactive mode, loc "
+                                   << curr.loc.toString();
+  nextToken();
+  CHECK_EQ(TOKEN_IDENTIFIER, currToken().type);
+  std::string name = currToken().identifier;
+  CommandAST* command = nullptr;
+  if (name == "job") {
+    nextToken();
+    ExprAST* expr = parseStatement();
+    CHECK(expr != nullptr);
+    command = new CommandAST(COMMAND_JOB, expr, 0, "", curr.loc);
+  } else if (name == "wait") {
+    nextToken();
+    CHECK_EQ(TOKEN_NUMBER, currToken().type);
+    uint64_t job_id = static_cast<uint64_t>(currToken().number);
+    command = new CommandAST(COMMAND_WAIT, nullptr, job_id, "", curr.loc);
+  } else if (name == "jobs") {
+    command = new CommandAST(COMMAND_JOBS, nullptr, 0, "", curr.loc);
+  } else if (name == "save") {
+    nextToken();
+    CHECK_EQ(TOKEN_STRING_LITERAL, currToken().type);
+    command = new CommandAST(COMMAND_SAVE, nullptr, 0, currToken().string_literal, curr.loc);
+  } else if (name == "mem") {
+    command = new CommandAST(COMMAND_MEM, nullptr, 0, "", curr.loc);
+  } else {
+    LOG(FATAL) << "Unknown command " << name << ", loc " << curr.loc.toString();
+  }
+  expr_storage.push_back(std::unique_ptr<ExprAST>(command));
+  return command;
+}
+
 void prepareParsePipeline() {
   resetLexer();
   expr_storage.clear();
+  user_defined_ops.clear();
+  op_priority_map = builtin_op_priority_map;
+  unary_op_set.clear();
+  for (auto& op : prelude_ops) {
+    defineUserOp(op);
+  }
 }
 
 ExprAST* parsePipeline() {
@@ -487,6 +723,8 @@ ExprAST* parsePipeline() {
   } else if (curr.type == TOKEN_DEF) {
     ret = parseFunction();
     CHECK(ret != nullptr);
+  } else if (isLetterToken(':')) {
+    ret = parseCommand();
   }
   if (ret != nullptr) {
     if (global_option.dump_ast) {
@@ -1,7 +1,9 @@
 #ifndef TOY_AST_H_
 #define TOY_AST_H_
 
+#include <memory>
 #include <string>
+#include <vector>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Value.h>
 
@@ -20,8 +22,18 @@ enum ASTType {
   IF_EXPR_AST,
   BLOCK_EXPR_AST,
   FOR_EXPR_AST,
+  COMMAND_AST,
 };
 
+// Type of values and variables, variables are double unless proven or declared otherwise.
+enum ValueType {
+  VALUE_TYPE_DOUBLE,
+  VALUE_TYPE_INT,
+  VALUE_TYPE_BOOL,
+};
+
+const char* getValueTypeName(ValueType type);
+
 class ExprAST {
  public:
   ExprAST(ASTType type, SourceLocation loc) : type_(type), loc_(loc) {
@@ -41,6 +53,12 @@ class ExprAST {
   virtual void dump(int indent = 0) const = 0;
   virtual llvm::Value* codegen() = 0;
 
+  // Return the simplified expression, which may be this or a new expression.
+  virtual ExprAST* simplify() = 0;
+
+  // Return the direct sub expressions.
+  virtual std::vector<ExprAST*> getChildren() const = 0;
+
  protected:
   std::string dumpHeader() const;
 
@@ -56,6 +74,12 @@ class NumberExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  double getVal() const {
+    return val_;
+  }
 
  private:
   double val_;
@@ -69,6 +93,8 @@ class StringLiteralExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
 
  private:
   const std::string val_;
@@ -82,6 +108,8 @@ class VariableExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
 
   const std::string& getName() const {
     return name_;
@@ -99,6 +127,12 @@ class UnaryExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  const OpType& getOp() const {
+    return op_;
+  }
 
  private:
   OpType op_;
@@ -108,44 +142,137 @@ class UnaryExprAST : public ExprAST {
 class BinaryExprAST : public ExprAST {
  public:
   BinaryExprAST(OpType op, ExprAST* left, ExprAST* right, SourceLocation loc)
-      : ExprAST(BINARY_EXPR_AST, loc), op_(op), left_(left), right_(right) {
+      : ExprAST(BINARY_EXPR_AST, loc),
+        op_(op),
+        left_(left),
+        right_(right),
+        no_signed_wrap_(false),
+        double_arithmetic_(false) {
   }
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  const OpType& getOp() const {
+    return op_;
+  }
+
+  ExprAST* getLeft() const {
+    return left_;
+  }
+
+  ExprAST* getRight() const {
+    return right_;
+  }
+
+  // Set when the result is proven to fit in int, so it can be computed with nsw integer
+  // arithmetic if both operands are int.
+  void setNoSignedWrap() {
+    no_signed_wrap_ = true;
+  }
+
+  // Set when an operand is an inferred int counter, so the arithmetic is done in double as if
+  // the counter were double.
+  void setDoubleArithmetic() {
+    double_arithmetic_ = true;
+  }
 
  private:
   OpType op_;
   ExprAST* left_;
   ExprAST* right_;
+  bool no_signed_wrap_;
+  bool double_arithmetic_;
 };
 
 class AssignmentExprAST : public ExprAST {
  public:
   AssignmentExprAST(const std::string& var_name, ExprAST* right, SourceLocation loc)
-      : ExprAST(ASSIGNMENT_EXPR_AST, loc), var_name_(var_name), right_(right) {
+      : ExprAST(ASSIGNMENT_EXPR_AST, loc),
+        var_name_(var_name),
+        right_(right),
+        value_type_(VALUE_TYPE_DOUBLE),
+        has_declared_type_(false) {
   }
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  const std::string& getVarName() const {
+    return var_name_;
+  }
+
+  ExprAST* getRight() const {
+    return right_;
+  }
+
+  // The type of the variable if it is created by this assignment.
+  ValueType getValueType() const {
+    return value_type_;
+  }
+
+  void setValueType(ValueType value_type) {
+    value_type_ = value_type;
+  }
+
+  // Declared like x: int = 3, the type isn't changed by type inference.
+  bool hasDeclaredType() const {
+    return has_declared_type_;
+  }
+
+  void setDeclaredType(ValueType value_type) {
+    value_type_ = value_type;
+    has_declared_type_ = true;
+  }
 
  private:
   const std::string var_name_;
   ExprAST* right_;
+  ValueType value_type_;
+  bool has_declared_type_;
 };
 
 class PrototypeAST : public ExprAST {
  public:
-  PrototypeAST(const std::string& name, const std::vector<std::string>& args, SourceLocation loc)
-      : ExprAST(PROTOTYPE_AST, loc), name_(name), args_(args) {
+  PrototypeAST(const std::string& name, const std::vector<std::string>& args,
+               const std::vector<ValueType>& arg_types, ValueType return_type, SourceLocation loc)
+      : ExprAST(PROTOTYPE_AST, loc),
+        name_(name),
+        args_(args),
+        arg_types_(arg_types),
+        return_type_(return_type) {
   }
 
   void dump(int indent = 0) const override;
   llvm::Function* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  const std::string& getName() const {
+    return name_;
+  }
+
+  const std::vector<std::string>& getArgs() const {
+    return args_;
+  }
+
+  const std::vector<ValueType>& getArgTypes() const {
+    return arg_types_;
+  }
+
+  ValueType getReturnType() const {
+    return return_type_;
+  }
 
  private:
   const std::string name_;
   std::vector<std::string> args_;
+  std::vector<ValueType> arg_types_;
+  ValueType return_type_;
 };
 
 class FunctionAST : public ExprAST {
@@ -156,11 +283,17 @@ class FunctionAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Function* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
 
   PrototypeAST* getPrototype() const {
     return prototype_;
   }
 
+  ExprAST* getBody() const {
+    return body_;
+  }
+
  private:
   PrototypeAST* prototype_;
   ExprAST* body_;
@@ -174,10 +307,16 @@ class CallExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  const std::string& getCallee() const {
+    return callee_;
+  }
 
  private:
   const std::string callee_;
-  const std::vector<ExprAST*> args_;
+  std::vector<ExprAST*> args_;
 };
 
 class IfExprAST : public ExprAST {
@@ -189,6 +328,8 @@ class IfExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
 
  private:
   std::vector<std::pair<ExprAST*, ExprAST*>> cond_then_exprs_;
@@ -203,9 +344,11 @@ class BlockExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
 
  private:
-  const std::vector<ExprAST*> exprs_;
+  std::vector<ExprAST*> exprs_;
 };
 
 class ForExprAST : public ExprAST {
@@ -221,6 +364,24 @@ class ForExprAST : public ExprAST {
 
   void dump(int indent = 0) const override;
   llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  ExprAST* getInitExpr() const {
+    return init_expr_;
+  }
+
+  ExprAST* getCondExpr() const {
+    return cond_expr_;
+  }
+
+  ExprAST* getNextExpr() const {
+    return next_expr_;
+  }
+
+  ExprAST* getBlockExpr() const {
+    return block_expr_;
+  }
 
  private:
   ExprAST* init_expr_;
@@ -229,6 +390,62 @@ class ForExprAST : public ExprAST {
   ExprAST* block_expr_;
 };
 
+enum CommandType {
+  COMMAND_JOB,
+  COMMAND_WAIT,
+  COMMAND_JOBS,
+  COMMAND_SAVE,
+  COMMAND_MEM,
+};
+
+// A REPL command, like ":job Statement", ":wait JobId", ":jobs", ":save Path" or ":mem". Only
+// the statement of a job command generates code.
+class CommandAST : public ExprAST {
+ public:
+  CommandAST(CommandType command, ExprAST* expr, uint64_t job_id, const std::string& path,
+             SourceLocation loc)
+      : ExprAST(COMMAND_AST, loc), command_(command), expr_(expr), job_id_(job_id), path_(path) {
+  }
+
+  void dump(int indent = 0) const override;
+  llvm::Value* codegen() override;
+  ExprAST* simplify() override;
+  std::vector<ExprAST*> getChildren() const override;
+
+  CommandType getCommand() const {
+    return command_;
+  }
+
+  uint64_t getJobId() const {
+    return job_id_;
+  }
+
+  const std::string& getPath() const {
+    return path_;
+  }
+
+ private:
+  const CommandType command_;
+  ExprAST* expr_;
+  const uint64_t job_id_;
+  const std::string path_;
+};
+
+// Owns all the ASTs created by the parser and the passes running on it.
+extern std::vector<std::unique_ptr<ExprAST>> expr_storage;
+
+// Operators defined by binary and unary functions.
+struct UserDefinedOp {
+  char letter;
+  bool is_binary;
+  int priority;
+};
+
+const std::vector<UserDefinedOp>& getUserDefinedOps();
+void defineUserOp(const UserDefinedOp& op);
+// Operators of preludes are defined again by each prepareParsePipeline().
+void addPreludeOp(const UserDefinedOp& op);
+
 // Used in interactive mode.
 void prepareParsePipeline();
 ExprAST* parsePipeline();
@@ -0,0 +1,77 @@
+#include "profile.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <unordered_map>
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "logging.h"
+#include "strings.h"
+
+// A profile has text lines:
+//   toy-profile 1
+//   <function> <count>...
+static const char profile_magic[] = "toy-profile 1";
+
+static std::unordered_map<std::string, std::vector<uint64_t>> profile_counts;
+
+bool writeProfile(const std::string& path, const char* layout, const uint64_t* counters) {
+  std::string content = std::string(profile_magic) + "\n";
+  for (auto& line : stringSplit(layout, '\n')) {
+    if (line.empty()) {
+      continue;
+    }
+    std::vector<std::string> fields = stringSplit(line, ' ');
+    CHECK_EQ(2u, fields.size()) << "invalid profile layout " << line;
+    size_t count = strtoull(fields[1].c_str(), nullptr, 10);
+    content += fields[0];
+    for (size_t i = 0; i < count; ++i) {
+      content += stringPrintf(" %" PRIu64, *counters++);
+    }
+    content += "\n";
+  }
+  return writeStringToFile(path, content);
+}
+
+bool loadProfile(const std::string& path) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    LOG(ERROR) << "Can't open profile " << path << ": " << buffer.getError().message();
+    return false;
+  }
+  if ((*buffer)->getBufferSize() == 0) {
+    LOG(ERROR) << "Profile " << path << " is empty";
+    return false;
+  }
+  std::vector<std::string> lines = stringSplit((*buffer)->getBuffer().str(), '\n');
+  if (lines[0] != profile_magic) {
+    LOG(ERROR) << path << " doesn't start with " << profile_magic;
+    return false;
+  }
+  profile_counts.clear();
+  for (size_t i = 1; i < lines.size(); ++i) {
+    if (lines[i].empty()) {
+      continue;
+    }
+    std::vector<std::string> fields = stringSplit(lines[i], ' ');
+    std::vector<uint64_t>& counts = profile_counts[fields[0]];
+    counts.clear();
+    for (size_t j = 1; j < fields.size(); ++j) {
+      char* end;
+      counts.push_back(strtoull(fields[j].c_str(), &end, 10));
+      if (fields[j].empty() || *end != '\0') {
+        LOG(ERROR) << "Invalid line in " << path << ": " << lines[i];
+        profile_counts.clear();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+const std::vector<uint64_t>* getProfileCounts(const std::string& function) {
+  auto it = profile_counts.find(function);
+  return (it == profile_counts.end() ? nullptr : &it->second);
+}
@@ -0,0 +1,23 @@
+#ifndef TOY_PROFILE_H_
+#define TOY_PROFILE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Code generated with --profile-generate counts, in each function, the calls of the function,
+// then the times each branch goes to each of its targets, in the order code is generated. The
+// counts are written to the profile when __toy_main returns, and --profile-use reads them back
+// to weight branches of the same source.
+
+// Write the counters of a run. Layout has a "<function> <counter count>" line for each function,
+// in the order of the counters.
+bool writeProfile(const std::string& path, const char* layout, const uint64_t* counters);
+
+// Load the profile used to generate code.
+bool loadProfile(const std::string& path);
+// Return the counts of the function in the loaded profile, or null if there are none.
+const std::vector<uint64_t>* getProfileCounts(const std::string& function);
+
+#endif  // TOY_PROFILE_H_
@@ -0,0 +1,275 @@
+#include "repl.h"
+
+#include <chrono>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "code.h"
+#include "execution.h"
+#include "lexer.h"
+#include "logging.h"
+#include "optimization.h"
+#include "option.h"
+#include "parse.h"
+#include "simplify.h"
+#include "snapshot.h"
+#include "type_inference.h"
+
+static std::function<void(const StatementTime&)> statement_time_callback;
+
+static double toSeconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
+}
+
+struct Statement {
+  std::chrono::steady_clock::time_point start;
+  StatementTime time;
+  // Null if the statement has no code or fails to generate code.
+  std::unique_ptr<llvm::Module> module;
+  // Set for REPL commands.
+  CommandAST* command;
+  // Set for the save command, whose module defines all functions of the session.
+  std::unique_ptr<SessionSnapshot> snapshot;
+  // In pipeline mode, the module is compiled on the optimization thread, see
+  // compileModulePipeline().
+  bool is_compiled;
+  uint64_t module_id;
+  double compile_seconds;
+};
+
+// Statements read together are compiled in one module, but a module is kept at a size that
+// is quick to optimize.
+static const size_t max_batch_statements = 256;
+
+// Parsed but not compiled with the previous batch.
+static ExprAST* pending_expr = nullptr;
+
+static ExprAST* nextExpr() {
+  ExprAST* expr = pending_expr;
+  pending_expr = nullptr;
+  return (expr != nullptr ? expr : parsePipeline());
+}
+
+// Return the name of the function defined or declared by expr, or "" if there is none.
+static std::string getFunctionName(ExprAST* expr) {
+  if (expr->type() == FUNCTION_AST) {
+    return reinterpret_cast<FunctionAST*>(expr)->getPrototype()->getName();
+  }
+  if (expr->type() == PROTOTYPE_AST) {
+    return reinterpret_cast<PrototypeAST*>(expr)->getName();
+  }
+  return "";
+}
+
+// Parse and generate code for the next statement, with the statements that follow it in
+// already buffered input. Return false at the end of input.
+static bool nextStatement(Statement* statement) {
+  statement->start = std::chrono::steady_clock::now();
+  statement->time = StatementTime();
+  statement->module = nullptr;
+  statement->command = nullptr;
+  statement->snapshot = nullptr;
+  statement->is_compiled = false;
+  statement->module_id = 0;
+  statement->compile_seconds = 0.0;
+  ExprAST* expr = nextExpr();
+  if (expr == nullptr) {
+    Token curr = currToken();
+    return curr.type != TOKEN_EOF;
+  }
+  if (expr->type() == COMMAND_AST) {
+    statement->command = reinterpret_cast<CommandAST*>(expr);
+    if (statement->command->getCommand() == COMMAND_SAVE) {
+      statement->snapshot.reset(new SessionSnapshot);
+      statement->module = captureSessionSnapshot(statement->snapshot.get());
+      return true;
+    }
+    if (statement->command->getCommand() != COMMAND_JOB) {
+      return true;
+    }
+    expr = simplifyPipeline(expr);
+    typeInferencePipeline(expr);
+    std::chrono::steady_clock::time_point code_start = std::chrono::steady_clock::now();
+    statement->time.parse_seconds = toSeconds(code_start - statement->start);
+    statement->module = codePipeline(expr);
+    statement->time.code_seconds = toSeconds(std::chrono::steady_clock::now() - code_start);
+    return true;
+  }
+  std::vector<ExprAST*> exprs;
+  std::set<std::string> function_names;
+  while (expr != nullptr) {
+    // Start a new module when a function is redefined. Otherwise the definition would be
+    // renamed, or calls in earlier statements of the module would bind to it.
+    std::string function_name = getFunctionName(expr);
+    bool is_redefinition = false;
+    if (!function_name.empty()) {
+      is_redefinition =
+          hasFunction(function_name) || !function_names.insert(function_name).second;
+    }
+    if (!exprs.empty() && (expr->type() == COMMAND_AST || is_redefinition)) {
+      pending_expr = expr;
+      break;
+    }
+    expr = simplifyPipeline(expr);
+    typeInferencePipeline(expr);
+    exprs.push_back(expr);
+    expr = nullptr;
+    while (expr == nullptr && exprs.size() < max_batch_statements && hasPendingInput()) {
+      expr = parsePipeline();
+      if (expr == nullptr && currToken().type == TOKEN_EOF) {
+        break;
+      }
+    }
+  }
+  std::chrono::steady_clock::time_point code_start = std::chrono::steady_clock::now();
+  statement->time.parse_seconds = toSeconds(code_start - statement->start);
+  statement->module = codePipeline(exprs);
+  statement->time.code_seconds = toSeconds(std::chrono::steady_clock::now() - code_start);
+  return true;
+}
+
+static void optimizeStatement(Statement* statement) {
+  if (statement->module != nullptr) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    optPipeline(statement->module.get());
+    statement->time.opt_seconds = toSeconds(std::chrono::steady_clock::now() - start);
+  }
+}
+
+static void compileStatement(Statement* statement) {
+  if (statement->command == nullptr && statement->module != nullptr) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    statement->module_id = compileModulePipeline(statement->module.release());
+    statement->is_compiled = true;
+    statement->compile_seconds = toSeconds(std::chrono::steady_clock::now() - start);
+  }
+}
+
+static void runStatement(Statement* statement) {
+  if (statement->command == nullptr) {
+    if (statement->is_compiled) {
+      runModulePipeline(statement->module_id);
+      statement->time.execution = getLastExecutionTime();
+      statement->time.execution.jit_seconds += statement->compile_seconds;
+    } else if (statement->module != nullptr) {
+      executionPipeline(statement->module.release());
+      statement->time.execution = getLastExecutionTime();
+    }
+    return;
+  }
+  switch (statement->command->getCommand()) {
+    case COMMAND_JOB:
+      if (statement->module != nullptr) {
+        startJobPipeline(statement->module.release());
+      }
+      break;
+    case COMMAND_WAIT:
+      waitJobPipeline(statement->command->getJobId());
+      break;
+    case COMMAND_JOBS:
+      listJobsPipeline();
+      break;
+    case COMMAND_MEM:
+      printJITMemoryPipeline();
+      break;
+    case COMMAND_SAVE:
+      if (statement->module == nullptr ||
+          !saveSessionSnapshot(*statement->snapshot, std::move(statement->module),
+                               statement->command->getPath())) {
+        LOG(ERROR) << "Failed to save snapshot " << statement->command->getPath();
+      }
+      break;
+  }
+}
+
+static void executeStatement(Statement* statement) {
+  runStatement(statement);
+  statement->time.total_seconds =
+      toSeconds(std::chrono::steady_clock::now() - statement->start);
+  if (statement_time_callback) {
+    statement_time_callback(statement->time);
+  }
+}
+
+static void serialLoop() {
+  Statement statement;
+  while (nextStatement(&statement)) {
+    optimizeStatement(&statement);
+    executeStatement(&statement);
+  }
+}
+
+// Statement N is executed while statement N + 1 is optimized and compiled, and statement N + 2
+// is parsed. Each module has its own LLVMContext, so the stages don't share LLVM state. Jobs
+// and commands are still compiled on the execution thread.
+static void pipelinedLoop() {
+  BlockingQueue<Statement> opt_queue;
+  BlockingQueue<Statement> execution_queue;
+  std::thread opt_thread([&]() {
+    Statement statement;
+    while (opt_queue.pop(&statement)) {
+      optimizeStatement(&statement);
+      compileStatement(&statement);
+      execution_queue.push(std::move(statement));
+    }
+    execution_queue.close();
+  });
+  std::thread execution_thread([&]() {
+    Statement statement;
+    while (execution_queue.pop(&statement)) {
+      executeStatement(&statement);
+    }
+  });
+  Statement statement;
+  while (nextStatement(&statement)) {
+    opt_queue.push(std::move(statement));
+  }
+  opt_queue.close();
+  opt_thread.join();
+  execution_thread.join();
+}
+
+void setStatementTimeCallback(std::function<void(const StatementTime&)> callback) {
+  statement_time_callback = callback;
+}
+
+void prepareRepl() {
+  prepareParsePipeline();
+  prepareSimplifyPipeline();
+  prepareTypeInferencePipeline();
+  prepareCodePipeline();
+  prepareOptPipeline();
+  prepareExecutionPipeline();
+}
+
+void replLoop() {
+  if (global_option.pipeline) {
+    pipelinedLoop();
+  } else {
+    serialLoop();
+  }
+}
+
+void finishRepl() {
+  finishExecutionPipeline();
+  finishCodePipeline();
+  finishOptPipeline();
+  finishTypeInferencePipeline();
+  finishSimplifyPipeline();
+  finishParsePipeline();
+}
+
+void interactiveMain() {
+  prepareRepl();
+  if (!global_option.restore_file.empty() &&
+      !restoreSessionSnapshot(global_option.restore_file)) {
+    LOG(ERROR) << "Failed to restore snapshot " << global_option.restore_file;
+  }
+  printPrompt();
+  replLoop();
+  finishRepl();
+}
@@ -0,0 +1,37 @@
+#ifndef TOY_REPL_H_
+#define TOY_REPL_H_
+
+#include <functional>
+
+#include "execution.h"
+
+// Time spent on a statement of the REPL, in seconds. Statements read together are compiled and
+// run as one statement.
+struct StatementTime {
+  StatementTime()
+      : parse_seconds(0.0), code_seconds(0.0), opt_seconds(0.0), execution(), total_seconds(0.0) {
+  }
+
+  // Parsing, simplifying and inferring types.
+  double parse_seconds;
+  double code_seconds;
+  double opt_seconds;
+  // Only set for statements run in the JIT.
+  ExecutionTime execution;
+  // From reading the statement until it is executed.
+  double total_seconds;
+};
+
+// Called with the time of each statement after it is executed, used by benchmarks.
+void setStatementTimeCallback(std::function<void(const StatementTime&)> callback);
+
+// Prepare and finish all stages of the REPL.
+void prepareRepl();
+void finishRepl();
+// Read, compile and execute statements from global_option.in_stream until the end of input.
+void replLoop();
+
+// The REPL, in interactive mode.
+void interactiveMain();
+
+#endif  // TOY_REPL_H_
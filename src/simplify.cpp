@@ -0,0 +1,262 @@
+#include "simplify.h"
+
+#include <math.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "logging.h"
+#include "parse.h"
+
+static bool getNumber(ExprAST* expr, double* val) {
+  if (expr->type() != NUMBER_EXPR_AST) {
+    return false;
+  }
+  *val = reinterpret_cast<NumberExprAST*>(expr)->getVal();
+  return true;
+}
+
+// Check if a constant number is true when used as a condition. Conditions are tested with
+// fcmp one 0.0, so NaN is false.
+static bool isTrueNumber(double val) {
+  return !isnan(val) && val != 0.0;
+}
+
+static ExprAST* createNumber(double val, SourceLocation loc) {
+  ExprAST* expr = new NumberExprAST(val, loc);
+  expr_storage.push_back(std::unique_ptr<ExprAST>(expr));
+  return expr;
+}
+
+// Fold a builtin binary operator, comparisons have the same ordered semantics as in codegen.
+static bool foldBinaryOp(const std::string& op, double left, double right, double* result) {
+  bool ordered = !isnan(left) && !isnan(right);
+  if (op == "<") {
+    *result = (left < right);
+  } else if (op == "<=") {
+    *result = (left <= right);
+  } else if (op == "==") {
+    *result = (left == right);
+  } else if (op == "!=") {
+    *result = (ordered && left != right);
+  } else if (op == ">") {
+    *result = (left > right);
+  } else if (op == ">=") {
+    *result = (left >= right);
+  } else if (op == "+") {
+    *result = left + right;
+  } else if (op == "-") {
+    *result = left - right;
+  } else if (op == "*") {
+    *result = left * right;
+  } else if (op == "/") {
+    *result = left / right;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+ExprAST* NumberExprAST::simplify() {
+  return this;
+}
+
+ExprAST* StringLiteralExprAST::simplify() {
+  return this;
+}
+
+ExprAST* VariableExprAST::simplify() {
+  return this;
+}
+
+ExprAST* UnaryExprAST::simplify() {
+  right_ = right_->simplify();
+  if (op_.desc != "-") {
+    return this;
+  }
+  double val;
+  if (getNumber(right_, &val)) {
+    return createNumber(-val, getLoc());
+  }
+  // -(-x) => x.
+  if (right_->type() == UNARY_EXPR_AST) {
+    UnaryExprAST* right = reinterpret_cast<UnaryExprAST*>(right_);
+    if (right->op_.desc == "-") {
+      return right->right_;
+    }
+  }
+  return this;
+}
+
+ExprAST* BinaryExprAST::simplify() {
+  left_ = left_->simplify();
+  right_ = right_->simplify();
+  double left_val;
+  double right_val;
+  bool left_is_number = getNumber(left_, &left_val);
+  bool right_is_number = getNumber(right_, &right_val);
+  const std::string& op = op_.desc;
+  if (left_is_number && right_is_number) {
+    double result;
+    if (foldBinaryOp(op, left_val, right_val, &result)) {
+      return createNumber(result, getLoc());
+    }
+    return this;
+  }
+  // Only strip identities which hold for every IEEE value, including -0.0 and NaN. So x + 0.0
+  // is kept, because -0.0 + 0.0 is 0.0.
+  if (right_is_number) {
+    if ((op == "*" || op == "/") && right_val == 1.0) {
+      return left_;
+    }
+    if (op == "-" && right_val == 0.0 && !signbit(right_val)) {
+      return left_;
+    }
+    if (op == "+" && right_val == 0.0 && signbit(right_val)) {
+      return left_;
+    }
+  }
+  if (left_is_number) {
+    if (op == "*" && left_val == 1.0) {
+      return right_;
+    }
+    if (op == "+" && left_val == 0.0 && signbit(left_val)) {
+      return right_;
+    }
+  }
+  return this;
+}
+
+ExprAST* AssignmentExprAST::simplify() {
+  right_ = right_->simplify();
+  return this;
+}
+
+ExprAST* PrototypeAST::simplify() {
+  return this;
+}
+
+ExprAST* FunctionAST::simplify() {
+  body_ = body_->simplify();
+  return this;
+}
+
+ExprAST* CallExprAST::simplify() {
+  for (auto& arg : args_) {
+    arg = arg->simplify();
+  }
+  return this;
+}
+
+// Codegen creates a variable at its first assignment even if the assignment never runs, and if
+// has no scope. So a part of an if is only dropped when it assigns no variable.
+static bool hasAssignment(ExprAST* expr) {
+  if (expr->type() == ASSIGNMENT_EXPR_AST) {
+    return true;
+  }
+  for (auto child : expr->getChildren()) {
+    if (hasAssignment(child)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ExprAST* IfExprAST::simplify() {
+  for (auto& pair : cond_then_exprs_) {
+    pair.first = pair.first->simplify();
+    pair.second = pair.second->simplify();
+  }
+  if (else_expr_ != nullptr) {
+    else_expr_ = else_expr_->simplify();
+  }
+  std::vector<std::pair<ExprAST*, ExprAST*>> cond_then_exprs;
+  ExprAST* else_expr = else_expr_;
+  for (size_t i = 0; i < cond_then_exprs_.size(); ++i) {
+    ExprAST* cond_expr = cond_then_exprs_[i].first;
+    ExprAST* then_expr = cond_then_exprs_[i].second;
+    double val;
+    if (!getNumber(cond_expr, &val)) {
+      cond_then_exprs.push_back(std::make_pair(cond_expr, then_expr));
+      continue;
+    }
+    if (!isTrueNumber(val)) {
+      // The arm is never taken.
+      if (hasAssignment(then_expr)) {
+        return this;
+      }
+      continue;
+    }
+    // The arm is taken when all previous arms aren't, so it is the new else arm, and the arms
+    // after it are never taken.
+    for (size_t j = i + 1; j < cond_then_exprs_.size(); ++j) {
+      if (hasAssignment(cond_then_exprs_[j].first) || hasAssignment(cond_then_exprs_[j].second)) {
+        return this;
+      }
+    }
+    if (else_expr_ != nullptr && hasAssignment(else_expr_)) {
+      return this;
+    }
+    else_expr = then_expr;
+    break;
+  }
+  if (cond_then_exprs.empty()) {
+    // Either an arm is always taken, or only the else arm is left.
+    return (else_expr != nullptr ? else_expr : createNumber(0.0, getLoc()));
+  }
+  cond_then_exprs_ = cond_then_exprs;
+  else_expr_ = else_expr;
+  return this;
+}
+
+ExprAST* BlockExprAST::simplify() {
+  std::vector<ExprAST*> exprs;
+  for (size_t i = 0; i < exprs_.size(); ++i) {
+    ExprAST* expr = exprs_[i]->simplify();
+    // A number not used as the block value has no effect.
+    if (expr->type() == NUMBER_EXPR_AST && i + 1 != exprs_.size()) {
+      continue;
+    }
+    exprs.push_back(expr);
+  }
+  exprs_ = exprs;
+  return this;
+}
+
+ExprAST* ForExprAST::simplify() {
+  init_expr_ = init_expr_->simplify();
+  cond_expr_ = cond_expr_->simplify();
+  next_expr_ = next_expr_->simplify();
+  block_expr_ = block_expr_->simplify();
+  return this;
+}
+
+ExprAST* CommandAST::simplify() {
+  if (expr_ != nullptr) {
+    expr_ = expr_->simplify();
+  }
+  return this;
+}
+
+void prepareSimplifyPipeline() {
+}
+
+ExprAST* simplifyPipeline(ExprAST* expr) {
+  ExprAST* result = expr->simplify();
+  CHECK(result != nullptr);
+  return result;
+}
+
+void finishSimplifyPipeline() {
+}
+
+std::vector<ExprAST*> simplifyMain(const std::vector<ExprAST*>& exprs) {
+  std::vector<ExprAST*> result;
+  prepareSimplifyPipeline();
+  for (auto expr : exprs) {
+    result.push_back(simplifyPipeline(expr));
+  }
+  finishSimplifyPipeline();
+  return result;
+}
@@ -0,0 +1,16 @@
+#ifndef TOY_SIMPLIFY_H_
+#define TOY_SIMPLIFY_H_
+
+#include <vector>
+
+class ExprAST;
+
+// Used in interactive mode.
+void prepareSimplifyPipeline();
+ExprAST* simplifyPipeline(ExprAST* expr);
+void finishSimplifyPipeline();
+
+// Used in non-interactive mode.
+std::vector<ExprAST*> simplifyMain(const std::vector<ExprAST*>& exprs);
+
+#endif  // TOY_SIMPLIFY_H_
@@ -0,0 +1,356 @@
+#include "snapshot.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <set>
+#include <sstream>
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "code.h"
+#include "execution.h"
+#include "logging.h"
+#include "strings.h"
+#include "supportlib.h"
+
+// A snapshot file starts with text lines:
+//   toy-snapshot 1
+//   op <letter> <is_binary> <priority>
+//   global <name> <value_type> <hex value bits>
+//   function <name> <object index, or -1 if only declared> <return_type> <arg count>
+//            [<arg> <arg_type>]...
+//   object <hex offset> <hex size>
+//   data
+// Objects follow at their offsets, aligned so they can be used in place in the mapped file.
+// The declarations index of a prelude has the op and function lines after a toy-prelude 1
+// line, and its functions are defined in object 0, the .o file.
+static const char snapshot_magic[] = "toy-snapshot 1";
+static const char prelude_magic[] = "toy-prelude 1";
+static const size_t object_alignment = 16;
+
+// Objects linked from the restored snapshot. They are saved again in later snapshots while
+// some of their functions are not redefined.
+static std::vector<llvm::StringRef> restored_objects;
+static std::map<std::string, size_t> restored_functions;
+static std::unique_ptr<llvm::MemoryBuffer> restored_file;
+
+// Loaded preludes are used by all sessions until exit.
+static std::vector<std::unique_ptr<llvm::MemoryBuffer>> prelude_files;
+static std::vector<std::unique_ptr<PrototypeAST>> prelude_prototypes;
+
+struct SnapshotFunction {
+  std::string name;
+  int object_index;
+  ValueType return_type;
+  std::vector<std::string> args;
+  std::vector<ValueType> arg_types;
+};
+
+// Lines of a snapshot header or a prelude declarations index.
+struct SnapshotIndex {
+  std::vector<UserDefinedOp> ops;
+  std::vector<std::pair<std::string, ValueType>> global_variables;
+  std::vector<uint64_t> global_values;
+  std::vector<SnapshotFunction> functions;
+  std::vector<std::pair<size_t, size_t>> objects;
+};
+
+std::unique_ptr<llvm::Module> captureSessionSnapshot(SessionSnapshot* snapshot) {
+  snapshot->ops = getUserDefinedOps();
+  snapshot->prototypes = getFunctionPrototypes();
+  snapshot->global_variables = getGlobalVariables();
+  return codeSnapshotPipeline();
+}
+
+static size_t alignOffset(size_t offset) {
+  return (offset + object_alignment - 1) / object_alignment * object_alignment;
+}
+
+static std::string formatOpLine(const UserDefinedOp& op) {
+  return stringPrintf("op %d %d %d\n", op.letter, op.is_binary, op.priority);
+}
+
+static std::string formatFunctionLine(PrototypeAST* prototype, int object_index) {
+  std::string line =
+      stringPrintf("function %s %d %d %zu", prototype->getName().c_str(), object_index,
+                   prototype->getReturnType(), prototype->getArgs().size());
+  for (size_t i = 0; i < prototype->getArgs().size(); ++i) {
+    line += stringPrintf(" %s %d", prototype->getArgs()[i].c_str(), prototype->getArgTypes()[i]);
+  }
+  return line + "\n";
+}
+
+bool saveSessionSnapshot(const SessionSnapshot& snapshot, std::unique_ptr<llvm::Module> module,
+                         const std::string& path) {
+  std::vector<std::string> functions;
+  std::string object = compileSnapshotObject(std::move(module), &functions);
+  std::set<std::string> new_functions(functions.begin(), functions.end());
+  // The new object is the first one, followed by restored objects still in use.
+  std::vector<llvm::StringRef> objects(1, object);
+  std::map<size_t, size_t> restored_object_indexes;
+
+  std::string header = std::string(snapshot_magic) + "\n";
+  for (auto& op : snapshot.ops) {
+    header += formatOpLine(op);
+  }
+  CHECK(snapshot.global_variables.size() * toy_global_slot_size <= toy_global_segment_size);
+  for (size_t i = 0; i < snapshot.global_variables.size(); ++i) {
+    uint64_t bits = 0;
+    memcpy(&bits, __toy_globals + i * toy_global_slot_size, toy_global_slot_size);
+    header += stringPrintf("global %s %d %" PRIx64 "\n", snapshot.global_variables[i].first.c_str(),
+                           snapshot.global_variables[i].second, bits);
+  }
+  for (auto prototype : snapshot.prototypes) {
+    int object_index = -1;
+    auto it = restored_functions.find(prototype->getName());
+    if (new_functions.find(prototype->getName()) != new_functions.end()) {
+      object_index = 0;
+    } else if (it != restored_functions.end()) {
+      auto index_it = restored_object_indexes.find(it->second);
+      if (index_it == restored_object_indexes.end()) {
+        index_it = restored_object_indexes.insert(std::make_pair(it->second, objects.size())).first;
+        objects.push_back(restored_objects[it->second]);
+      }
+      object_index = static_cast<int>(index_it->second);
+    }
+    header += formatFunctionLine(prototype, object_index);
+  }
+  // Object lines have a fixed width, so offsets are known before they are written.
+  const size_t object_line_size = std::string("object 0000000000000000 0000000000000000\n").size();
+  size_t offset = alignOffset(header.size() + objects.size() * object_line_size + strlen("data\n"));
+  std::string data;
+  for (auto& object : objects) {
+    header += stringPrintf("object %016zx %016zx\n", offset + data.size(), object.size());
+    data += object.str();
+    data.resize(alignOffset(data.size()));
+  }
+  header += "data\n";
+  header.resize(offset);
+  if (!writeStringToFile(path, header + data, true)) {
+    LOG(ERROR) << "Can't write snapshot " << path;
+    return false;
+  }
+  return true;
+}
+
+static bool isValueType(int type) {
+  return type == VALUE_TYPE_DOUBLE || type == VALUE_TYPE_INT || type == VALUE_TYPE_BOOL;
+}
+
+// Parse a line into the index, or return false if it is invalid.
+static bool parseIndexLine(const std::string& line, SnapshotIndex* index) {
+  std::istringstream is(line);
+  std::string kind;
+  is >> kind;
+  if (kind == "op") {
+    int letter, is_binary, priority;
+    is >> letter >> is_binary >> priority;
+    index->ops.push_back(UserDefinedOp{static_cast<char>(letter), is_binary != 0, priority});
+  } else if (kind == "global") {
+    std::string name;
+    int type;
+    std::string bits;
+    is >> name >> type >> bits;
+    if (!isValueType(type)) {
+      return false;
+    }
+    index->global_variables.push_back(std::make_pair(name, static_cast<ValueType>(type)));
+    index->global_values.push_back(strtoull(bits.c_str(), nullptr, 16));
+  } else if (kind == "function") {
+    SnapshotFunction function;
+    int return_type;
+    size_t arg_count;
+    is >> function.name >> function.object_index >> return_type >> arg_count;
+    if (!isValueType(return_type)) {
+      return false;
+    }
+    function.return_type = static_cast<ValueType>(return_type);
+    for (size_t i = 0; i < arg_count && is; ++i) {
+      std::string arg;
+      int arg_type;
+      is >> arg >> arg_type;
+      if (!isValueType(arg_type)) {
+        return false;
+      }
+      function.args.push_back(arg);
+      function.arg_types.push_back(static_cast<ValueType>(arg_type));
+    }
+    index->functions.push_back(function);
+  } else if (kind == "object") {
+    size_t offset, size;
+    is >> std::hex >> offset >> size;
+    index->objects.push_back(std::make_pair(offset, size));
+  } else {
+    return false;
+  }
+  return !is.fail();
+}
+
+// Parse lines of content until a data line, or until the end if has_data is false.
+static bool parseIndex(llvm::StringRef content, const char* magic, bool has_data,
+                       const std::string& path, SnapshotIndex* index) {
+  size_t pos = 0;
+  for (size_t line_count = 0; has_data || pos < content.size(); ++line_count) {
+    size_t end = content.find('\n', pos);
+    if (end == llvm::StringRef::npos) {
+      LOG(ERROR) << "Truncated " << path;
+      return false;
+    }
+    std::string line = content.substr(pos, end - pos).str();
+    pos = end + 1;
+    if (line_count == 0) {
+      if (line != magic) {
+        LOG(ERROR) << path << " doesn't start with " << magic;
+        return false;
+      }
+    } else if (has_data && line == "data") {
+      break;
+    } else if (!parseIndexLine(line, index)) {
+      LOG(ERROR) << "Invalid line in " << path << ": " << line;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Check that functions are declared, or defined in one of object_count objects.
+static bool checkFunctionObjects(const SnapshotIndex& index, size_t object_count,
+                                 const std::string& path) {
+  for (auto& function : index.functions) {
+    if (function.object_index < -1 || function.object_index >= static_cast<int>(object_count)) {
+      LOG(ERROR) << "Invalid object of function " << function.name << " in " << path;
+      return false;
+    }
+  }
+  return true;
+}
+
+static PrototypeAST* createPrototype(const SnapshotFunction& function) {
+  return new PrototypeAST(function.name, function.args, function.arg_types, function.return_type,
+                          SourceLocation());
+}
+
+bool restoreSessionSnapshot(const std::string& path) {
+  // Large files are mapped instead of read.
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(path, -1, false);
+  if (!buffer) {
+    LOG(ERROR) << "Can't open snapshot " << path << ": " << buffer.getError().message();
+    return false;
+  }
+  llvm::StringRef content = (*buffer)->getBuffer();
+  SnapshotIndex index;
+  if (!parseIndex(content, snapshot_magic, true, path, &index) ||
+      !checkFunctionObjects(index, index.objects.size(), path)) {
+    return false;
+  }
+  if (index.global_variables.size() * toy_global_slot_size > toy_global_segment_size) {
+    LOG(ERROR) << "Too many global variables in snapshot " << path;
+    return false;
+  }
+  for (auto& object : index.objects) {
+    if (object.first > content.size() || object.second > content.size() - object.first) {
+      LOG(ERROR) << "Truncated snapshot " << path;
+      return false;
+    }
+  }
+
+  for (auto& op : index.ops) {
+    defineUserOp(op);
+  }
+  for (size_t i = 0; i < index.global_variables.size(); ++i) {
+    restoreGlobalVariable(index.global_variables[i].first, index.global_variables[i].second);
+    memcpy(__toy_globals + i * toy_global_slot_size, &index.global_values[i],
+           toy_global_slot_size);
+  }
+  std::vector<std::vector<std::string>> object_functions(index.objects.size());
+  for (auto& function : index.functions) {
+    PrototypeAST* prototype = createPrototype(function);
+    expr_storage.push_back(std::unique_ptr<ExprAST>(prototype));
+    restoreFunctionPrototype(prototype);
+    if (function.object_index != -1) {
+      object_functions[function.object_index].push_back(function.name);
+    }
+  }
+  restored_objects.clear();
+  restored_functions.clear();
+  for (size_t i = 0; i < index.objects.size(); ++i) {
+    llvm::StringRef object = content.substr(index.objects[i].first, index.objects[i].second);
+    addSnapshotObject(object, object_functions[i]);
+    for (auto& name : object_functions[i]) {
+      restored_functions[name] = restored_objects.size();
+    }
+    restored_objects.push_back(object);
+  }
+  // Restored objects point into the file, which is kept for later snapshots.
+  restored_file = std::move(*buffer);
+  LOG(DEBUG) << "restored " << index.functions.size() << " functions and "
+             << index.global_variables.size() << " global variables from " << path;
+  return true;
+}
+
+bool savePrelude(const std::vector<UserDefinedOp>& ops,
+                 const std::vector<PrototypeAST*>& prototypes, std::unique_ptr<llvm::Module> module,
+                 const std::string& path) {
+  std::vector<std::string> functions;
+  std::string object = compileSnapshotObject(std::move(module), &functions);
+  std::set<std::string> defined_functions(functions.begin(), functions.end());
+  std::string decls = std::string(prelude_magic) + "\n";
+  for (auto& op : ops) {
+    decls += formatOpLine(op);
+  }
+  for (auto prototype : prototypes) {
+    bool is_defined = (defined_functions.find(prototype->getName()) != defined_functions.end());
+    decls += formatFunctionLine(prototype, (is_defined ? 0 : -1));
+  }
+  if (!writeStringToFile(path + ".o", object, true) ||
+      !writeStringToFile(path + ".decls", decls)) {
+    LOG(ERROR) << "Can't write prelude " << path;
+    return false;
+  }
+  return true;
+}
+
+bool loadPrelude(const std::string& path) {
+  std::string decls_path = path + ".decls";
+  std::string object_path = path + ".o";
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> decls =
+      llvm::MemoryBuffer::getFile(decls_path);
+  if (!decls) {
+    LOG(ERROR) << "Can't open " << decls_path << ": " << decls.getError().message();
+    return false;
+  }
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> object =
+      llvm::MemoryBuffer::getFile(object_path, -1, false);
+  if (!object) {
+    LOG(ERROR) << "Can't open " << object_path << ": " << object.getError().message();
+    return false;
+  }
+  SnapshotIndex index;
+  if (!parseIndex((*decls)->getBuffer(), prelude_magic, false, decls_path, &index) ||
+      !checkFunctionObjects(index, 1, decls_path)) {
+    return false;
+  }
+  if (!index.global_variables.empty() || !index.objects.empty()) {
+    LOG(ERROR) << "Prelude " << decls_path << " can only have operators and functions";
+    return false;
+  }
+  for (auto& op : index.ops) {
+    addPreludeOp(op);
+  }
+  std::vector<std::string> functions;
+  for (auto& function : index.functions) {
+    prelude_prototypes.push_back(std::unique_ptr<PrototypeAST>(createPrototype(function)));
+    addPreludeFunction(prelude_prototypes.back().get());
+    if (function.object_index == 0) {
+      functions.push_back(function.name);
+    }
+  }
+  addPreludeObject((*object)->getBuffer(), functions);
+  prelude_files.push_back(std::move(*object));
+  LOG(DEBUG) << "loaded " << functions.size() << " functions from prelude " << path;
+  return true;
+}
@@ -0,0 +1,44 @@
+#ifndef TOY_SNAPSHOT_H_
+#define TOY_SNAPSHOT_H_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <llvm/IR/Module.h>
+
+#include "parse.h"
+
+// A snapshot of a REPL session holds user defined operators, function prototypes, global
+// variables with their values, and objects compiled from the function definitions. Restoring
+// it links the objects without compiling anything.
+struct SessionSnapshot {
+  std::vector<UserDefinedOp> ops;
+  std::vector<PrototypeAST*> prototypes;
+  std::vector<std::pair<std::string, ValueType>> global_variables;
+};
+
+// Capture the definitions of the session, and return the module defining its functions. It
+// must be called where code is generated, before the statements after the save command.
+std::unique_ptr<llvm::Module> captureSessionSnapshot(SessionSnapshot* snapshot);
+
+// Compile the optimized module, and write the snapshot with the current values of global
+// variables. It must be called where code is executed.
+bool saveSessionSnapshot(const SessionSnapshot& snapshot, std::unique_ptr<llvm::Module> module,
+                         const std::string& path);
+
+// Restore a snapshot at the start of an interactive session.
+bool restoreSessionSnapshot(const std::string& path);
+
+// A prelude is a library of functions precompiled into <path>.o, with a declarations index of
+// its operators and prototypes in <path>.decls. Save the prelude from the module generated by
+// codePreludeMain().
+bool savePrelude(const std::vector<UserDefinedOp>& ops,
+                 const std::vector<PrototypeAST*>& prototypes, std::unique_ptr<llvm::Module> module,
+                 const std::string& path);
+
+// Load a prelude before the first session. Its functions are available in all sessions, without
+// parsing or generating code for them.
+bool loadPrelude(const std::string& path);
+
+#endif  // TOY_SNAPSHOT_H_
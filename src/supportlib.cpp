@@ -1,12 +1,72 @@
 #include "supportlib.h"
 
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "logging.h"
 #include "option.h"
+#include "profile.h"
+
+// Jobs in interactive mode may print at the same time.
+static std::mutex output_mutex;
+
+// Runs the iterations of a parallel loop with index values in [begin, end), and stores its
+// partial sums of the reductions.
+typedef void (*ParallelLoopBody)(void* env, int64_t begin, int64_t end, double* partial_sums);
+
+// Each thread takes about this many chunks of a parallel loop, so threads finishing early take
+// chunks of the others.
+static const size_t chunks_per_thread = 4;
+
+// Threads helping the caller of parallel loops. They are started by the first parallel loop and
+// never exit, so they are left blocked on the queue at exit.
+static BlockingQueue<std::function<void()>>* parallel_tasks;
+static size_t parallel_thread_count;
+
+static void startParallelThreads() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    parallel_thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    parallel_tasks = new BlockingQueue<std::function<void()>>;
+    for (size_t i = 1; i < parallel_thread_count; ++i) {
+      std::thread([]() {
+        std::function<void()> task;
+        while (parallel_tasks->pop(&task)) {
+          task();
+        }
+      }).detach();
+    }
+  });
+}
+
+// The loop runs while index < end, or index <= end if inclusive. Indexes are int counters
+// within 2^53 compared as doubles, so it is the same as index < limit.
+static int64_t getParallelLoopLimit(double end, bool inclusive) {
+  if (isnan(end)) {
+    return INT64_MIN;
+  }
+  const double max_index = 9007199254740992.0;
+  end = std::max(std::min(end, max_index), -max_index);
+  return static_cast<int64_t>(inclusive ? floor(end) + 1 : ceil(end));
+}
 
 extern "C" {
 
+// It is in bss, so pages are only allocated when global variables in them are used.
+alignas(4096) char __toy_globals[toy_global_segment_size];
+
 double print(const char* s) {
+  std::lock_guard<std::mutex> lock(output_mutex);
   global_option.out_stream->write(s, strlen(s));
   return 0.0;
 }
@@ -23,10 +83,78 @@ double printd(double x) {
     p--;
   }
   *(p + 1) = '\0';
+  std::lock_guard<std::mutex> lock(output_mutex);
   global_option.out_stream->write(buf, strlen(buf));
   return 0.0;
 }
 
+// Print the result of a statement compiled with the following statements in interactive mode.
+double __toy_result(double x) {
+  printf("->%lf\n", x);
+  fflush(stdout);
+  return x;
+}
+
+// Called when __toy_main returns in code generated with --profile-generate.
+void __toy_write_profile(const char* path, const char* layout, const uint64_t* counters) {
+  if (!writeProfile(path, layout, counters)) {
+    LOG(ERROR) << "Failed to write profile " << path;
+  }
+}
+
+// Called by loops parallelized with --auto-parallel. Iterations are split into chunks in order,
+// and the partial sums of the chunks are added to reductions in the same order.
+void __toy_parallel_for(ParallelLoopBody body, void* env, int64_t begin, double end,
+                        int64_t inclusive, int64_t step, double* reductions,
+                        int64_t reduction_count) {
+  int64_t limit = getParallelLoopLimit(end, inclusive != 0);
+  if (limit <= begin) {
+    return;
+  }
+  startParallelThreads();
+  uint64_t iterations = (static_cast<uint64_t>(limit - begin) - 1) / step + 1;
+  size_t chunk_count = static_cast<size_t>(
+      std::min<uint64_t>(iterations, parallel_thread_count * chunks_per_thread));
+  std::vector<double> partial_sums(chunk_count * reduction_count, -0.0);
+  // The first chunks take one more iteration when they can't be equal.
+  auto get_chunk_begin = [&](size_t chunk) {
+    uint64_t first =
+        chunk * (iterations / chunk_count) + std::min<uint64_t>(chunk, iterations % chunk_count);
+    return begin + static_cast<int64_t>(first) * step;
+  };
+  std::atomic<size_t> next_chunk(0);
+  auto run_chunks = [&]() {
+    size_t chunk;
+    while ((chunk = next_chunk++) < chunk_count) {
+      body(env, get_chunk_begin(chunk), get_chunk_begin(chunk + 1),
+           &partial_sums[chunk * reduction_count]);
+    }
+  };
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t helpers = std::min(parallel_thread_count, chunk_count) - 1;
+  size_t running_helpers = helpers;
+  for (size_t i = 0; i < helpers; ++i) {
+    parallel_tasks->push([&]() {
+      run_chunks();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--running_helpers == 0) {
+        cond.notify_one();
+      }
+    });
+  }
+  run_chunks();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&]() { return running_helpers == 0; });
+  }
+  for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+    for (int64_t i = 0; i < reduction_count; ++i) {
+      reductions[i] += partial_sums[chunk * reduction_count + i];
+    }
+  }
+}
+
 }  // extern "C"
 
 void initSupportLib() {
@@ -4,6 +4,13 @@
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 
+// Size of the memory holding global variables of JIT modules in interactive mode.
+const size_t toy_global_segment_size = 16 * 1024 * 1024;
+// Each global variable takes one slot of the segment, in creation order.
+const size_t toy_global_slot_size = 8;
+
+extern "C" char __toy_globals[toy_global_segment_size];
+
 void initSupportLib();
 
 #endif  // TOY_SUPPORT_LIB_H_
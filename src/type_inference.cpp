@@ -0,0 +1,199 @@
+#include "type_inference.h"
+
+#include <math.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "logging.h"
+#include "parse.h"
+
+// Integers up to 2^53 are exact in double, so an int variable initialized within this range
+// holds the same value the double variable would.
+static const double max_exact_integer = 9007199254740992.0;
+
+// Limit of c in counter updates like v = v + c. Starting within max_exact_integer, it takes
+// more than 2^52 updates for v to overflow int64, so the updates are computed with nsw.
+static const double max_counter_step = 1024.0;
+
+// Global variables, which aren't changed by type inference. In non-interactive mode they are
+// the variables declared with a type anywhere in the program. In interactive mode later
+// statements aren't known, so they are all the global variables assigned so far, whose names
+// resolve to the globals in regions compiled later.
+static std::set<std::string> global_names;
+
+struct CounterInfo {
+  CounterInfo() : is_counter(true) {
+  }
+
+  bool is_counter;
+  std::vector<AssignmentExprAST*> assignments;
+  std::vector<BinaryExprAST*> updates;
+};
+
+static bool isIntegralNumber(ExprAST* expr, double max_abs) {
+  if (expr->type() != NUMBER_EXPR_AST) {
+    return false;
+  }
+  double val = reinterpret_cast<NumberExprAST*>(expr)->getVal();
+  return val == floor(val) && fabs(val) <= max_abs;
+}
+
+static bool isVariable(ExprAST* expr, const std::string& name) {
+  return expr->type() == VARIABLE_EXPR_AST &&
+         reinterpret_cast<VariableExprAST*>(expr)->getName() == name;
+}
+
+// Return the binary expression if expr is one of name + c, c + name, name - c.
+static BinaryExprAST* getCounterUpdate(ExprAST* expr, const std::string& name) {
+  if (expr->type() != BINARY_EXPR_AST) {
+    return nullptr;
+  }
+  BinaryExprAST* binary = reinterpret_cast<BinaryExprAST*>(expr);
+  ExprAST* left = binary->getLeft();
+  ExprAST* right = binary->getRight();
+  const std::string& op = binary->getOp().desc;
+  if (op == "+") {
+    if ((isVariable(left, name) && isIntegralNumber(right, max_counter_step)) ||
+        (isIntegralNumber(left, max_counter_step) && isVariable(right, name))) {
+      return binary;
+    }
+  } else if (op == "-") {
+    if (isVariable(left, name) && isIntegralNumber(right, max_counter_step)) {
+      return binary;
+    }
+  }
+  return nullptr;
+}
+
+static void collectAssignments(ExprAST* expr, std::map<std::string, CounterInfo>* counters) {
+  if (expr->type() == ASSIGNMENT_EXPR_AST) {
+    AssignmentExprAST* assignment = reinterpret_cast<AssignmentExprAST*>(expr);
+    CounterInfo& info = (*counters)[assignment->getVarName()];
+    info.assignments.push_back(assignment);
+    if (assignment->hasDeclaredType()) {
+      info.is_counter = false;
+    }
+    ExprAST* right = assignment->getRight();
+    BinaryExprAST* update = getCounterUpdate(right, assignment->getVarName());
+    if (update != nullptr) {
+      info.updates.push_back(update);
+    } else if (!isIntegralNumber(right, max_exact_integer)) {
+      info.is_counter = false;
+    }
+  }
+  for (auto child : expr->getChildren()) {
+    collectAssignments(child, counters);
+  }
+}
+
+static bool isArithmeticOp(const std::string& op) {
+  return op != "<" && op != "<=" && op != "==" && op != "!=" && op != ">" && op != ">=";
+}
+
+// Counters hold the same values as doubles would, but other arithmetic on them isn't proven to
+// fit in int, so it is done in double.
+static void markDoubleArithmetic(ExprAST* expr, const std::string& name,
+                                 const std::set<BinaryExprAST*>& updates) {
+  if (expr->type() == BINARY_EXPR_AST) {
+    BinaryExprAST* binary = reinterpret_cast<BinaryExprAST*>(expr);
+    if (updates.find(binary) == updates.end() && isArithmeticOp(binary->getOp().desc) &&
+        (isVariable(binary->getLeft(), name) || isVariable(binary->getRight(), name))) {
+      binary->setDoubleArithmetic();
+    }
+  }
+  for (auto child : expr->getChildren()) {
+    markDoubleArithmetic(child, name, updates);
+  }
+}
+
+// A region is a function body or a top level for loop, so variables created in it are local
+// and can't be assigned outside. A variable is an int counter if each assignment to it in the
+// region is an integral constant or a counter update. The types are only used when codegen
+// creates the variable, names resolved to arguments or globals stay double. Arguments and
+// variables declared with a type are skipped.
+static void inferRegion(ExprAST* region, const std::vector<std::string>& args) {
+  std::map<std::string, CounterInfo> counters;
+  collectAssignments(region, &counters);
+  for (auto& arg : args) {
+    auto it = counters.find(arg);
+    if (it != counters.end()) {
+      it->second.is_counter = false;
+    }
+  }
+  for (auto& pair : counters) {
+    const CounterInfo& info = pair.second;
+    if (!info.is_counter || global_names.find(pair.first) != global_names.end()) {
+      continue;
+    }
+    LOG(DEBUG) << "infer int counter " << pair.first << ", loc "
+               << region->getLoc().toString();
+    for (auto assignment : info.assignments) {
+      assignment->setValueType(VALUE_TYPE_INT);
+    }
+    for (auto update : info.updates) {
+      update->setNoSignedWrap();
+    }
+    std::set<BinaryExprAST*> updates(info.updates.begin(), info.updates.end());
+    markDoubleArithmetic(region, pair.first, updates);
+  }
+}
+
+// Collect global variables assigned outside regions, only the ones declared with a type if
+// only_declared is set.
+static void collectGlobalNames(ExprAST* expr, bool only_declared) {
+  if (expr->type() == FUNCTION_AST || expr->type() == FOR_EXPR_AST) {
+    return;
+  }
+  if (expr->type() == ASSIGNMENT_EXPR_AST) {
+    AssignmentExprAST* assignment = reinterpret_cast<AssignmentExprAST*>(expr);
+    if (!only_declared || assignment->hasDeclaredType()) {
+      global_names.insert(assignment->getVarName());
+    }
+  }
+  for (auto child : expr->getChildren()) {
+    collectGlobalNames(child, only_declared);
+  }
+}
+
+static void inferTopLevelRegions(ExprAST* expr) {
+  if (expr->type() == FUNCTION_AST) {
+    FunctionAST* function = reinterpret_cast<FunctionAST*>(expr);
+    inferRegion(function->getBody(), function->getPrototype()->getArgs());
+    return;
+  }
+  if (expr->type() == FOR_EXPR_AST) {
+    inferRegion(expr, std::vector<std::string>());
+    return;
+  }
+  for (auto child : expr->getChildren()) {
+    inferTopLevelRegions(child);
+  }
+}
+
+void prepareTypeInferencePipeline() {
+  global_names.clear();
+}
+
+void typeInferencePipeline(ExprAST* expr) {
+  collectGlobalNames(expr, false);
+  inferTopLevelRegions(expr);
+}
+
+void finishTypeInferencePipeline() {
+  global_names.clear();
+}
+
+void typeInferenceMain(const std::vector<ExprAST*>& exprs) {
+  global_names.clear();
+  // A global variable may be declared after the functions using it.
+  for (auto expr : exprs) {
+    collectGlobalNames(expr, true);
+  }
+  for (auto expr : exprs) {
+    inferTopLevelRegions(expr);
+  }
+  global_names.clear();
+}
@@ -0,0 +1,16 @@
+#ifndef TOY_TYPE_INFERENCE_H_
+#define TOY_TYPE_INFERENCE_H_
+
+#include <vector>
+
+class ExprAST;
+
+// Used in interactive mode.
+void prepareTypeInferencePipeline();
+void typeInferencePipeline(ExprAST* expr);
+void finishTypeInferencePipeline();
+
+// Used in non-interactive mode.
+void typeInferenceMain(const std::vector<ExprAST*>& exprs);
+
+#endif  // TOY_TYPE_INFERENCE_H_
@@ -1,8 +1,11 @@
 #include "gtest.h"
 
 #include <dirent.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <memory>
 #include <string>
@@ -14,6 +17,11 @@
 #include <option.h>
 #include <optimization.h>
 #include <parse.h>
+#include <profile.h>
+#include <repl.h>
+#include <simplify.h>
+#include <snapshot.h>
+#include <type_inference.h>
 
 static bool enumerateTestScripts(std::vector<std::string>* script_names) {
   script_names->clear();
@@ -85,6 +93,8 @@ static bool executeScript(const std::string& script, bool use_debug, std::string
   global_option.out_stream = &oss;
   global_option.debug = use_debug;
   std::vector<ExprAST*> exprs = parseMain();
+  exprs = simplifyMain(exprs);
+  typeInferenceMain(exprs);
   std::unique_ptr<llvm::Module> module = codeMain(exprs);
   optMain(module.get());
   executionMain(module.release());
@@ -92,6 +102,56 @@ static bool executeScript(const std::string& script, bool use_debug, std::string
   return true;
 }
 
+// Run a REPL session on the script, after restoring the snapshot if restore_file isn't empty.
+// What the script prints is returned in *output, and what the REPL prints to stdout in
+// *repl_output.
+static bool runInteractiveSession(const std::string& script, const std::string& restore_file,
+                                  std::string* output, std::string* repl_output) {
+  global_option.interactive = true;
+  global_option.execute = true;
+  std::istringstream iss(script);
+  global_option.input_file = "string";
+  global_option.in_stream = &iss;
+  std::ostringstream oss;
+  global_option.output_file = "string";
+  global_option.out_stream = &oss;
+  testing::internal::CaptureStdout();
+  prepareRepl();
+  bool success = restore_file.empty() || restoreSessionSnapshot(restore_file);
+  if (success) {
+    replLoop();
+  }
+  finishRepl();
+  *repl_output = testing::internal::GetCapturedStdout();
+  global_option.interactive = false;
+  *output = oss.str();
+  return success;
+}
+
+static bool readFile(const std::string& path, std::string* content) {
+  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(path.c_str(), "rb"), fclose);
+  if (fp == nullptr) {
+    LOG(ERROR) << "failed to open file " << path << ": " << strerror(errno);
+    return false;
+  }
+  content->clear();
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
+    content->append(buf, n);
+  }
+  return true;
+}
+
+static bool writeFile(const std::string& path, const std::string& content) {
+  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(path.c_str(), "wb"), fclose);
+  if (fp == nullptr) {
+    LOG(ERROR) << "failed to open file " << path << ": " << strerror(errno);
+    return false;
+  }
+  return fwrite(content.data(), 1, content.size(), fp.get()) == content.size();
+}
+
 void runScripts(bool use_debug, bool* success) {
   *success = false;
   std::vector<std::string> script_names;
@@ -120,3 +180,181 @@ TEST(script_test, run_scripts_debug) {
   runScripts(true, &success);
   ASSERT_TRUE(success);
 }
+
+// Loops proven independent run in parallel, with the same output.
+TEST(script_test, run_scripts_auto_parallel) {
+  bool success;
+  global_option.auto_parallel = true;
+  runScripts(false, &success);
+  if (success) {
+    runScripts(true, &success);
+  }
+  global_option.auto_parallel = false;
+  ASSERT_TRUE(success);
+}
+
+// The counts written with --profile-generate are read back by --profile-use.
+TEST(script_test, profile_round_trip) {
+  char path[] = "/tmp/toy_profile_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  close(fd);
+  std::string script =
+      "def f(x) {\n"
+      "  if (x < 3) {\n"
+      "    1;\n"
+      "  } else {\n"
+      "    2;\n"
+      "  }\n"
+      "}\n"
+      "for (i = 0; i < 5; i = i + 1) {\n"
+      "  f(i);\n"
+      "}\n";
+  std::string output;
+  global_option.profile_generate_file = path;
+  bool success = executeScript(script, false, &output);
+  global_option.profile_generate_file.clear();
+  std::string content;
+  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(path, "r"), fclose);
+  ASSERT_TRUE(fp != nullptr);
+  char buf[1024];
+  while (fgets(buf, sizeof(buf), fp.get()) != nullptr) {
+    content.append(buf);
+  }
+  ASSERT_TRUE(success);
+  // The loop body of __toy_main runs 5 times. f is entered 5 times, takes the then branch 3
+  // times and the else branch 2 times.
+  ASSERT_EQ("toy-profile 1\n__toy_main 1 5 1\nf 5 3 2\n", content);
+
+  ASSERT_TRUE(loadProfile(path));
+  const std::vector<uint64_t>* counts = getProfileCounts("f");
+  ASSERT_TRUE(counts != nullptr);
+  ASSERT_EQ(std::vector<uint64_t>({5, 3, 2}), *counts);
+  ASSERT_TRUE(getProfileCounts("g") == nullptr);
+
+  ASSERT_EQ(0, truncate(path, 0));
+  ASSERT_FALSE(loadProfile(path));
+  unlink(path);
+}
+
+// A session saved by :save is restored into a fresh session, and a damaged snapshot is rejected
+// before anything is restored.
+TEST(script_test, snapshot_round_trip) {
+  char path[] = "/tmp/toy_snapshot_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  close(fd);
+  std::string script =
+      "def square(x) {\n"
+      "  x * x;\n"
+      "}\n"
+      "def half(n: int): int {\n"
+      "  n / 2;\n"
+      "}\n"
+      "def binary! 5 (a, b) {\n"
+      "  a * 10 + b;\n"
+      "}\n"
+      "count: int = 42;\n"
+      "ratio = 2.5;\n"
+      ":save \"" + std::string(path) + "\"\n";
+  std::string output;
+  std::string repl_output;
+  ASSERT_TRUE(runInteractiveSession(script, "", &output, &repl_output));
+  std::string content;
+  ASSERT_TRUE(readFile(path, &content));
+  ASSERT_EQ(0u, content.find("toy-snapshot 1\n"));
+
+  script =
+      "printd(square(3));\n"
+      "print(\"\\n\");\n"
+      "printd(1 ! 2 + 3);\n"
+      "print(\"\\n\");\n"
+      "printd(count);\n"
+      "print(\"\\n\");\n"
+      "printd(ratio);\n"
+      "print(\"\\n\");\n"
+      "printd(half(count));\n"
+      "print(\"\\n\");\n";
+  ASSERT_TRUE(runInteractiveSession(script, path, &output, &repl_output));
+  ASSERT_EQ("9\n15\n42\n2.5\n21\n", output);
+
+  // The objects are cut off, or a function refers to an object that doesn't exist. Both are
+  // found after the operators and global variables of the index are read.
+  std::string truncated_path = std::string(path) + ".truncated";
+  ASSERT_TRUE(writeFile(truncated_path, content.substr(0, content.size() / 2)));
+  std::string corrupt = content;
+  std::string function_line = "\nfunction square ";
+  size_t pos = corrupt.find(function_line);
+  ASSERT_NE(std::string::npos, pos);
+  corrupt[pos + function_line.size()] = '7';
+  std::string corrupt_path = std::string(path) + ".corrupt";
+  ASSERT_TRUE(writeFile(corrupt_path, corrupt));
+  global_option.interactive = true;
+  prepareRepl();
+  bool truncated_restored = restoreSessionSnapshot(truncated_path);
+  bool corrupt_restored = restoreSessionSnapshot(corrupt_path);
+  bool has_ops = !getUserDefinedOps().empty();
+  bool has_globals = !getGlobalVariables().empty();
+  bool has_square = hasFunction("square");
+  finishRepl();
+  global_option.interactive = false;
+  unlink(truncated_path.c_str());
+  unlink(corrupt_path.c_str());
+  unlink(path);
+  ASSERT_FALSE(truncated_restored);
+  ASSERT_FALSE(corrupt_restored);
+  ASSERT_FALSE(has_ops);
+  ASSERT_FALSE(has_globals);
+  ASSERT_FALSE(has_square);
+}
+
+// Read the module counts printed by each :mem command.
+static void parseMemoryCounts(const std::string& repl_output, std::vector<uint64_t>* in_use,
+                              std::vector<uint64_t>* freed) {
+  in_use->clear();
+  freed->clear();
+  size_t pos = 0;
+  while ((pos = repl_output.find("in use: ", pos)) != std::string::npos) {
+    uint64_t in_use_count;
+    uint64_t freed_count;
+    if (sscanf(repl_output.c_str() + pos, "in use: %" SCNu64 " modules%*[^\n]\nfreed: %" SCNu64,
+               &in_use_count, &freed_count) == 2) {
+      in_use->push_back(in_use_count);
+      freed->push_back(freed_count);
+    }
+    pos++;
+  }
+}
+
+// A caller compiled before f is redefined calls the new body through the stub of f, and the
+// module of the old body is freed.
+TEST(script_test, redefine_function) {
+  std::string script =
+      "def f(x) {\n"
+      "  x + 1;\n"
+      "}\n"
+      ":mem\n"
+      "def g(x) {\n"
+      "  f(x) * 2;\n"
+      "}\n"
+      "printd(g(1));\n"
+      "print(\"\\n\");\n"
+      ":mem\n"
+      "def f(x) {\n"
+      "  x + 10;\n"
+      "}\n"
+      ":mem\n"
+      "printd(g(1));\n"
+      "print(\"\\n\");\n";
+  std::string output;
+  std::string repl_output;
+  ASSERT_TRUE(runInteractiveSession(script, "", &output, &repl_output));
+  ASSERT_EQ("4\n22\n", output);
+  std::vector<uint64_t> in_use;
+  std::vector<uint64_t> freed;
+  parseMemoryCounts(repl_output, &in_use, &freed);
+  ASSERT_EQ(3u, in_use.size());
+  // The module of the new f replaces the module of the old one.
+  ASSERT_EQ(in_use[1], in_use[2]);
+  ASSERT_EQ(freed[1] + 1, freed[2]);
+}